@@ -0,0 +1,992 @@
+// Benchmarks of the libuv/libcurl bridge of the speed test client.
+//
+// The benchmarks link the client (speedtest.h) and libspdtest (with the hooks of
+// spdtest_internal.h), so the callbacks are measured as the speed test runs them rather than as
+// copies: micro-benchmarks call the client's write and read callbacks, the engine's socket
+// callback and its completion sweep in tight loops, macro-benchmarks run whole transfers through
+// the engine against a server thread on loopback, and the DNS benchmark times the engine's
+// resolver against a stand-in name server on loopback. Results can be saved as a baseline and
+// later runs compared against it with a regression threshold.
+#define _GNU_SOURCE // strcasestr, RUSAGE_THREAD
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <curl/curl.h>
+#include <uv.h>
+#include "spdtest.h"
+#include "spdtest_internal.h"
+#include "speedtest.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+#else
+#define HAVE_CYCLE_COUNTER 0
+#endif
+
+#define BENCH_MAX_RESULTS 32
+#define BENCH_DEFAULT_REPETITIONS 5
+#define BENCH_DEFAULT_THRESHOLD_PCT 10.0
+#define BENCH_DEFAULT_CONNECTIONS 4
+#define BENCH_DEFAULT_BYTES_PER_CONNECTION (128LL * 1024 * 1024)
+#define BENCH_SERVER_CHUNK (1024 * 1024)
+#define BENCH_DNS_LOOKUPS 1000
+#define BENCH_DNS_CACHED_LOOKUPS 100000
+#define BENCH_DNS_CONCURRENCY 64 // Lookups in flight at once; more overflow the stand-in's socket buffer
+
+// One measured quantity. Lower is better unless higher_is_better is set; informational metrics
+// are saved and printed but never fail the threshold check.
+typedef struct {
+    char name[64];
+    double value;
+    const char *unit;
+    int higher_is_better;
+    int informational;
+} bench_metric_t;
+
+static struct {
+    int repetitions;
+    int connections;
+    long long bytes_per_connection;
+    int modes_selected; // --micro, --macro or --dns was given; only those run
+    int run_micro;
+    int run_macro;
+    int run_dns;
+    const char *save_path;
+    const char *baseline_path;
+    double threshold_pct;
+} bench_config;
+
+static uv_loop_t *loop;
+static spdtest_engine_t *engine; // The client's, see speedtest_client_init
+static bench_metric_t bench_results[BENCH_MAX_RESULTS];
+static int bench_num_results = 0;
+static int bench_failures = 0; // Benchmarks that failed outright and recorded nothing
+static double cycles_per_ns = 0.0; // Cycle counter rate, 0 without one
+
+static void add_metric(const char *name, double value, const char *unit, int higher_is_better, int informational) {
+    if (bench_num_results == BENCH_MAX_RESULTS) {
+        return;
+    }
+    bench_metric_t *metric = &bench_results[bench_num_results++];
+    snprintf(metric->name, sizeof(metric->name), "%s", name);
+    metric->value = value;
+    metric->unit = unit;
+    metric->higher_is_better = higher_is_better;
+    metric->informational = informational;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t read_cycles(void) {
+#if HAVE_CYCLE_COUNTER
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// The time stamp counter ticks at a constant rate; measured against uv_hrtime over 50 ms
+static void calibrate_cycle_counter(void) {
+    if (!HAVE_CYCLE_COUNTER) {
+        return;
+    }
+    uint64_t start_ns = uv_hrtime();
+    uint64_t start_cycles = read_cycles();
+    while (uv_hrtime() - start_ns < 50 * 1000 * 1000) {
+    }
+    cycles_per_ns = (double)(read_cycles() - start_cycles) / (double)(uv_hrtime() - start_ns);
+}
+
+static double thread_cpu_seconds(void) {
+    struct rusage usage;
+#ifdef RUSAGE_THREAD
+    if (getrusage(RUSAGE_THREAD, &usage) != 0) {
+        return 0.0;
+    }
+#else
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0.0;
+    }
+#endif
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// --- Micro-benchmarks ---
+
+typedef void (*micro_op_t)(void *ctx, long long ops);
+
+// Runs ops operations per repetition and records the median ns/op and cycles/op (and cycles/byte
+// when the operation moves bytes_per_op bytes)
+static void run_micro(const char *name, micro_op_t op, void *ctx, long long ops, double bytes_per_op) {
+    double ns_per_op[bench_config.repetitions];
+    double cycles_per_op[bench_config.repetitions];
+    op(ctx, ops / 10 + 1); // Warm caches and branch predictors
+    for (int r = 0; r < bench_config.repetitions; ++r) {
+        uint64_t start_ns = uv_hrtime();
+        uint64_t start_cycles = read_cycles();
+        op(ctx, ops);
+        cycles_per_op[r] = (double)(read_cycles() - start_cycles) / ops;
+        ns_per_op[r] = (double)(uv_hrtime() - start_ns) / ops;
+    }
+    qsort(ns_per_op, bench_config.repetitions, sizeof(double), compare_doubles);
+    qsort(cycles_per_op, bench_config.repetitions, sizeof(double), compare_doubles);
+    double ns = ns_per_op[bench_config.repetitions / 2];
+    double cycles = cycles_per_op[bench_config.repetitions / 2];
+
+    char metric[64];
+    printf("  %-28s %10.1f ns/op", name, ns);
+    snprintf(metric, sizeof(metric), "%s.ns_per_op", name);
+    add_metric(metric, ns, "ns/op", 0, 0);
+    if (HAVE_CYCLE_COUNTER) {
+        printf("  %10.1f cycles/op", cycles);
+        if (bytes_per_op > 0.0) {
+            printf("  %7.4f cycles/byte", cycles / bytes_per_op);
+            snprintf(metric, sizeof(metric), "%s.cycles_per_byte", name);
+            add_metric(metric, cycles / bytes_per_op, "cycles/byte", 0, 0);
+        }
+    }
+    if (bytes_per_op > 0.0) {
+        printf("  %8.0f callbacks/GB", 1e9 / bytes_per_op);
+    }
+    printf("\n");
+}
+
+#define MICRO_CHUNK_BYTES (16 * 1024) // CURL_MAX_WRITE_SIZE, what libcurl hands to the write callback
+#define MICRO_READ_BYTES (64 * 1024) // CURLOPT_UPLOAD_BUFFERSIZE default
+
+static char micro_buffer[MICRO_READ_BYTES];
+
+static void op_write_callback(void *ctx, long long ops) {
+    for (long long i = 0; i < ops; ++i) {
+        speedtest_download_write(micro_buffer, 1, MICRO_CHUNK_BYTES, ctx);
+    }
+}
+
+static void op_read_callback(void *ctx, long long ops) {
+    for (long long i = 0; i < ops; ++i) {
+        speedtest_stream_rewind(ctx);
+        speedtest_upload_read(micro_buffer, 1, MICRO_READ_BYTES, ctx);
+    }
+}
+
+// libcurl switching a known socket between waiting for input and output, as during a request
+static void op_socket_action(void *ctx, long long ops) {
+    for (long long i = 0; i < ops; ++i) {
+        spdtest_engine_update_socket(engine, ctx, (i & 1) ? CURL_POLL_OUT : CURL_POLL_IN);
+    }
+}
+
+static void op_completion_sweep(void *ctx, long long ops) {
+    for (long long i = 0; i < ops; ++i) {
+        spdtest_engine_harvest(engine);
+    }
+}
+
+static void run_micro_benchmarks(void) {
+    printf("Micro-benchmarks (median of %d runs):\n", bench_config.repetitions);
+
+    speedtest_stream_t *download = speedtest_stream_create(SPEEDTEST_STREAM_DOWNLOAD, 0, 0);
+    speedtest_stream_t *striped_download = speedtest_stream_create(SPEEDTEST_STREAM_DOWNLOAD, 0, 1);
+    speedtest_stream_t *upload = speedtest_stream_create(SPEEDTEST_STREAM_UPLOAD, 0, 0);
+    speedtest_stream_t *ring_upload = speedtest_stream_create(SPEEDTEST_STREAM_UPLOAD_RING, 0, 0);
+    if (!download || !striped_download || !upload || !ring_upload) {
+        fprintf(stderr, "Error: Failed to allocate benchmark streams.\n");
+        exit(1);
+    }
+    run_micro("write_callback", op_write_callback, download, 2000000, MICRO_CHUNK_BYTES);
+    // Striped and per-server accounting
+    run_micro("write_callback_server", op_write_callback, striped_download, 2000000, MICRO_CHUNK_BYTES);
+    run_micro("read_callback", op_read_callback, upload, 200000, MICRO_READ_BYTES);
+    speedtest_set_open_ended_uploads(1); // Wraps around the ring
+    run_micro("read_callback_ring", op_read_callback, ring_upload, 200000, MICRO_READ_BYTES);
+    speedtest_set_open_ended_uploads(0);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+        // Polled as a socket libcurl opened; curl_multi_assign would refuse a descriptor libcurl
+        // does not know
+        void *socket_ctx = spdtest_engine_open_socket(engine, fds[0]);
+        if (socket_ctx) {
+            run_micro("socket_action_update", op_socket_action, socket_ctx, 1000000, 0.0);
+            spdtest_engine_close_socket(engine, socket_ctx);
+            uv_run(loop, UV_RUN_NOWAIT);
+        } else {
+            bench_failures++;
+        }
+        close(fds[0]);
+        close(fds[1]);
+    } else {
+        fprintf(stderr, "Error: socketpair failed, socket_action_update not measured.\n");
+        bench_failures++;
+    }
+
+    run_micro("completion_sweep_idle", op_completion_sweep, NULL, 1000000, 0.0);
+
+    speedtest_stream_free(download);
+    speedtest_stream_free(striped_download);
+    speedtest_stream_free(upload);
+    speedtest_stream_free(ring_upload);
+    printf("\n");
+}
+// --- End Micro-benchmarks ---
+
+// --- Loopback server ---
+// Runs on its own loop in a separate thread, so the bridge under test keeps its loop to itself.
+// GET /<bytes> answers with that many bytes; PUT and POST read a Content-Length body and answer
+// with a short 200. Every connection is closed after its response.
+
+typedef struct {
+    uv_tcp_t handle;
+    char header[4096];
+    size_t header_len;
+    int header_done;
+    long long body_left; // Upload bytes still to read
+    long long send_left; // Download bytes still to write
+    uv_write_t write_req;
+} bench_conn_t;
+
+static uv_loop_t server_loop;
+static uv_tcp_t server_listener;
+static uv_async_t server_stop;
+static uv_thread_t server_thread;
+static int server_port;
+static char *server_payload;
+
+static void on_bench_conn_closed(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static void close_bench_conn(bench_conn_t *conn) {
+    if (!uv_is_closing((uv_handle_t *)&conn->handle)) {
+        uv_close((uv_handle_t *)&conn->handle, on_bench_conn_closed);
+    }
+}
+
+static void send_next_chunk(bench_conn_t *conn);
+
+static void on_chunk_written(uv_write_t *req, int status) {
+    bench_conn_t *conn = req->data;
+    if (status < 0 || conn->send_left == 0) {
+        close_bench_conn(conn);
+        return;
+    }
+    send_next_chunk(conn);
+}
+
+// One chunk in flight at a time keeps the memory bounded whatever the response size
+static void send_next_chunk(bench_conn_t *conn) {
+    size_t len = conn->send_left < BENCH_SERVER_CHUNK ? (size_t)conn->send_left : BENCH_SERVER_CHUNK;
+    uv_buf_t buf = uv_buf_init(server_payload, len);
+    conn->send_left -= len;
+    conn->write_req.data = conn;
+    if (uv_write(&conn->write_req, (uv_stream_t *)&conn->handle, &buf, 1, on_chunk_written) != 0) {
+        close_bench_conn(conn);
+    }
+}
+
+static void send_response(bench_conn_t *conn, long long body_bytes) {
+    static char header[128];
+    int len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\nConnection: close\r\n\r\n", body_bytes);
+    memcpy(server_payload, header, len); // Header and first body bytes go out in one write
+    long long first = body_bytes < BENCH_SERVER_CHUNK - len ? body_bytes : BENCH_SERVER_CHUNK - len;
+    uv_buf_t buf = uv_buf_init(server_payload, len + first);
+    conn->send_left = body_bytes - first;
+    conn->write_req.data = conn;
+    if (uv_write(&conn->write_req, (uv_stream_t *)&conn->handle, &buf, 1, on_chunk_written) != 0) {
+        close_bench_conn(conn);
+    }
+}
+
+static void on_bench_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    static char read_buffer[256 * 1024]; // Upload bodies are discarded
+    bench_conn_t *conn = handle->data;
+    if (conn->header_done) {
+        *buf = uv_buf_init(read_buffer, sizeof(read_buffer));
+    } else {
+        *buf = uv_buf_init(conn->header + conn->header_len, sizeof(conn->header) - conn->header_len - 1);
+    }
+}
+
+static void on_bench_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    bench_conn_t *conn = stream->data;
+    if (nread < 0) {
+        close_bench_conn(conn);
+        return;
+    }
+    if (conn->header_done) {
+        conn->body_left -= nread;
+    } else {
+        conn->header_len += nread;
+        conn->header[conn->header_len] = '\0';
+        char *end = strstr(conn->header, "\r\n\r\n");
+        if (!end) {
+            if (conn->header_len == sizeof(conn->header) - 1) {
+                close_bench_conn(conn);
+            }
+            return;
+        }
+        conn->header_done = 1;
+        if (strncmp(conn->header, "GET ", 4) == 0) {
+            uv_read_stop(stream);
+            send_response(conn, atoll(conn->header + 5)); // "GET /<bytes>"
+            return;
+        }
+        char *length = strcasestr(conn->header, "\r\nContent-Length:");
+        conn->body_left = (length ? atoll(length + 17) : 0) - (long long)(conn->header + conn->header_len - (end + 4));
+    }
+    if (conn->body_left <= 0) {
+        uv_read_stop(stream);
+        send_response(conn, 0);
+    }
+}
+
+static void on_bench_connection(uv_stream_t *listener, int status) {
+    if (status < 0) {
+        return;
+    }
+    bench_conn_t *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        return;
+    }
+    uv_tcp_init(&server_loop, &conn->handle);
+    conn->handle.data = conn;
+    if (uv_accept(listener, (uv_stream_t *)&conn->handle) != 0) {
+        close_bench_conn(conn);
+        return;
+    }
+    uv_read_start((uv_stream_t *)&conn->handle, on_bench_alloc, on_bench_read);
+}
+
+static void on_server_stop(uv_async_t *handle) {
+    uv_close((uv_handle_t *)&server_listener, NULL);
+    uv_close((uv_handle_t *)&server_stop, NULL);
+}
+
+static void run_server_loop(void *arg) {
+    uv_run(&server_loop, UV_RUN_DEFAULT);
+}
+
+static int start_bench_server(void) {
+    server_payload = calloc(1, BENCH_SERVER_CHUNK);
+    if (!server_payload || uv_loop_init(&server_loop) != 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    uv_tcp_init(&server_loop, &server_listener);
+    if (uv_tcp_bind(&server_listener, (const struct sockaddr *)&addr, 0) != 0 ||
+        uv_listen((uv_stream_t *)&server_listener, 512, on_bench_connection) != 0) {
+        return -1;
+    }
+    struct sockaddr_in bound;
+    int len = sizeof(bound);
+    uv_tcp_getsockname(&server_listener, (struct sockaddr *)&bound, &len);
+    server_port = ntohs(bound.sin_port);
+    uv_async_init(&server_loop, &server_stop, on_server_stop);
+    return uv_thread_create(&server_thread, run_server_loop, NULL);
+}
+
+static void stop_bench_server(void) {
+    uv_async_send(&server_stop);
+    uv_thread_join(&server_thread);
+    uv_loop_close(&server_loop);
+    free(server_payload);
+}
+// --- End Loopback server ---
+
+// --- Macro-benchmarks ---
+
+static long long macro_callbacks = 0;
+
+static size_t counting_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    macro_callbacks++;
+    return speedtest_download_write(ptr, size, nmemb, userdata);
+}
+
+static size_t counting_read_callback(char *dest_buffer, size_t size, size_t nitems, void *userp) {
+    macro_callbacks++;
+    return speedtest_upload_read(dest_buffer, size, nitems, userp);
+}
+
+// Runs one transfer per connection through the bridge and records throughput, callbacks per GB
+// and the CPU cost of the client thread per byte
+static void run_macro(const char *name, int upload) {
+    int connections = bench_config.connections;
+    long long bytes_per_connection = bench_config.bytes_per_connection;
+    char url[128];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/%lld", server_port, bytes_per_connection);
+
+    // Uploads share one payload, as the client's own upload test does
+    speedtest_stream_t *streams[connections];
+    for (int i = 0; i < connections; ++i) {
+        streams[i] = i == 0 ? speedtest_stream_create(upload ? SPEEDTEST_STREAM_UPLOAD : SPEEDTEST_STREAM_DOWNLOAD,
+                                                      (size_t)bytes_per_connection, 0)
+                            : speedtest_stream_share(streams[0]);
+        if (!streams[i]) {
+            fprintf(stderr, "Error: Failed to allocate the %s benchmark.\n", name);
+            exit(1);
+        }
+    }
+    CURL *easy_handles[connections];
+    int added = 0;
+    macro_callbacks = 0;
+    speedtest_take_failed_transfers();
+    double cpu_start_s = thread_cpu_seconds();
+    uint64_t start_ns = uv_hrtime();
+    for (int i = 0; i < connections; ++i) {
+        CURL *easy = curl_easy_init();
+        easy_handles[i] = easy;
+        if (!easy) {
+            fprintf(stderr, "Error: curl_easy_init failed for %s connection %d.\n", name, i + 1);
+            continue;
+        }
+        curl_easy_setopt(easy, CURLOPT_URL, url);
+        if (upload) {
+            curl_easy_setopt(easy, CURLOPT_UPLOAD, 1L);
+            curl_easy_setopt(easy, CURLOPT_READFUNCTION, counting_read_callback);
+            curl_easy_setopt(easy, CURLOPT_READDATA, streams[i]);
+            curl_easy_setopt(easy, CURLOPT_INFILESIZE_LARGE, (curl_off_t)bytes_per_connection);
+        } else {
+            curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, counting_write_callback);
+            curl_easy_setopt(easy, CURLOPT_WRITEDATA, streams[i]);
+        }
+        CURLMcode mc = spdtest_engine_add(engine, easy);
+        if (mc != CURLM_OK) {
+            fprintf(stderr, "Error: Cannot add %s connection %d: %s\n", name, i + 1, curl_multi_strerror(mc));
+            continue;
+        }
+        added++;
+    }
+    if (added > 0) {
+        spdtest_engine_run(engine);
+    }
+    double seconds = (uv_hrtime() - start_ns) / 1e9;
+    double cpu_s = thread_cpu_seconds() - cpu_start_s;
+
+    long long bytes = 0;
+    for (int i = connections - 1; i >= 0; --i) { // streams[0] holds the shared payload
+        bytes += speedtest_stream_bytes(streams[i]);
+        curl_easy_cleanup(easy_handles[i]); // No-op for NULL
+        speedtest_stream_free(streams[i]);
+    }
+    int failed = speedtest_take_failed_transfers() + (connections - added);
+    if (failed > 0 || bytes == 0) {
+        fprintf(stderr, "Error: %s benchmark had %d failed transfer(s).\n", name, failed);
+        bench_failures++;
+        return;
+    }
+
+    double gbps = bytes * 8.0 / seconds / 1e9;
+    double callbacks_per_gb = macro_callbacks / (bytes / 1e9);
+    double cpu_ns_per_byte = cpu_s * 1e9 / bytes;
+    char metric[64];
+    printf("  %-10s %6.2f Gbit/s  %8.0f callbacks/GB (%.0f bytes each)  %6.3f CPU ns/byte", name, gbps, callbacks_per_gb,
+           (double)bytes / macro_callbacks, cpu_ns_per_byte);
+    snprintf(metric, sizeof(metric), "%s.gbps", name);
+    add_metric(metric, gbps, "Gbit/s", 1, 0);
+    snprintf(metric, sizeof(metric), "%s.callbacks_per_gb", name);
+    add_metric(metric, callbacks_per_gb, "callbacks/GB", 0, 1);
+    snprintf(metric, sizeof(metric), "%s.cpu_ns_per_byte", name);
+    add_metric(metric, cpu_ns_per_byte, "ns/byte", 0, 0);
+    if (cycles_per_ns > 0.0) {
+        printf("  %6.3f cycles/byte", cpu_ns_per_byte * cycles_per_ns);
+        snprintf(metric, sizeof(metric), "%s.cycles_per_byte", name);
+        add_metric(metric, cpu_ns_per_byte * cycles_per_ns, "cycles/byte", 0, 0);
+    }
+    printf("\n");
+}
+
+static void run_macro_benchmarks(void) {
+    if (start_bench_server() != 0) {
+        fprintf(stderr, "Error: Failed to start the loopback server.\n");
+        exit(1);
+    }
+    printf("Macro-benchmarks (%d connection(s) x %lld bytes over loopback, best of %d runs):\n", bench_config.connections,
+           bench_config.bytes_per_connection, bench_config.repetitions);
+    const char *names[] = {"download", "upload"};
+    for (int upload = 0; upload <= 1; ++upload) {
+        // The best run is the one least disturbed by the rest of the system
+        int first_result = bench_num_results;
+        bench_metric_t best[4];
+        int best_count = 0;
+        for (int r = 0; r < bench_config.repetitions; ++r) {
+            bench_num_results = first_result;
+            run_macro(names[upload], upload);
+            if (bench_num_results > first_result &&
+                (best_count == 0 || bench_results[first_result].value > best[0].value)) {
+                best_count = bench_num_results - first_result;
+                memcpy(best, &bench_results[first_result], best_count * sizeof(bench_metric_t));
+            }
+        }
+        memcpy(&bench_results[first_result], best, best_count * sizeof(bench_metric_t));
+        bench_num_results = first_result + best_count;
+    }
+    stop_bench_server();
+    printf("\n");
+}
+// --- End Macro-benchmarks ---
+
+// --- DNS benchmark ---
+// A stand-in name server on its own loop and thread answers every A query with 127.0.0.1 (TTL 60)
+// and every other query with an empty NOERROR, so the lookups time the engine's resolver path
+// (c-ares driven by the loop, the cache and the pinned answers) rather than a real network.
+
+#define DNS_HEADER_LEN 12
+#define DNS_MAX_MESSAGE 512
+
+typedef struct {
+    uv_udp_send_t req;
+    char message[DNS_MAX_MESSAGE];
+} dns_reply_t;
+
+static uv_loop_t dns_server_loop;
+static uv_udp_t dns_server_socket;
+static uv_async_t dns_server_stop;
+static uv_thread_t dns_server_thread;
+static int dns_server_port;
+static char dns_server_buffer[DNS_MAX_MESSAGE];
+
+static void on_dns_reply_sent(uv_udp_send_t *req, int status) {
+    free(req->data);
+}
+
+static void on_dns_server_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    buf->base = dns_server_buffer;
+    buf->len = sizeof(dns_server_buffer);
+}
+
+static void on_dns_query(uv_udp_t *socket, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+    if (nread <= DNS_HEADER_LEN || !addr) {
+        return;
+    }
+    // Skip the question name to find its type; only single question queries are answered
+    const unsigned char *query = (const unsigned char *)buf->base;
+    size_t pos = DNS_HEADER_LEN;
+    while (pos < (size_t)nread && query[pos] != 0) {
+        pos += query[pos] + 1;
+    }
+    size_t question_end = pos + 5; // Terminating zero, type and class
+    if (question_end > (size_t)nread || query[4] != 0 || query[5] != 1) {
+        return;
+    }
+    int is_a = query[pos + 1] == 0 && query[pos + 2] == 1;
+
+    dns_reply_t *reply = malloc(sizeof(*reply));
+    if (!reply) {
+        return;
+    }
+    unsigned char *message = (unsigned char *)reply->message;
+    memcpy(message, query, question_end);
+    message[2] = 0x81; // Response, recursion desired
+    message[3] = 0x80; // Recursion available, NOERROR
+    memset(message + 6, 0, 6); // Answer, authority and additional counts
+    size_t len = question_end;
+    if (is_a) {
+        static const unsigned char answer[] = {
+            0xc0, DNS_HEADER_LEN, // Name: pointer to the question
+            0, 1, 0, 1, // Type A, class IN
+            0, 0, 0, 60, // TTL
+            0, 4, 127, 0, 0, 1
+        };
+        message[7] = 1;
+        memcpy(message + len, answer, sizeof(answer));
+        len += sizeof(answer);
+    }
+    reply->req.data = reply;
+    uv_buf_t out = uv_buf_init(reply->message, len);
+    if (uv_udp_send(&reply->req, socket, &out, 1, addr, on_dns_reply_sent) != 0) {
+        free(reply);
+    }
+}
+
+static void on_dns_server_stop(uv_async_t *handle) {
+    uv_close((uv_handle_t *)&dns_server_socket, NULL);
+    uv_close((uv_handle_t *)&dns_server_stop, NULL);
+}
+
+static void run_dns_server_loop(void *arg) {
+    uv_run(&dns_server_loop, UV_RUN_DEFAULT);
+}
+
+static int start_dns_server(void) {
+    if (uv_loop_init(&dns_server_loop) != 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    uv_udp_init(&dns_server_loop, &dns_server_socket);
+    if (uv_udp_bind(&dns_server_socket, (const struct sockaddr *)&addr, 0) != 0 ||
+        uv_udp_recv_start(&dns_server_socket, on_dns_server_alloc, on_dns_query) != 0) {
+        return -1;
+    }
+    struct sockaddr_in bound;
+    int len = sizeof(bound);
+    uv_udp_getsockname(&dns_server_socket, (struct sockaddr *)&bound, &len);
+    dns_server_port = ntohs(bound.sin_port);
+    uv_async_init(&dns_server_loop, &dns_server_stop, on_dns_server_stop);
+    return uv_thread_create(&dns_server_thread, run_dns_server_loop, NULL);
+}
+
+static void stop_dns_server(void) {
+    uv_async_send(&dns_server_stop);
+    uv_thread_join(&dns_server_thread);
+    uv_loop_close(&dns_server_loop);
+}
+
+static int dns_lookups_done = 0;
+static int dns_lookups_failed = 0;
+
+static void on_bench_resolved(spdtest_engine_t *resolving_engine, const spdtest_dns_result_t *result, void *user_data) {
+    dns_lookups_done++;
+    if (result->status != 0) {
+        dns_lookups_failed++;
+    }
+}
+
+// Resolves a name that is not cached yet and waits for the answer; returns the latency in us,
+// or a negative value when the lookup failed
+static double timed_lookup(spdtest_engine_t *dns_engine, const char *url) {
+    dns_lookups_done = 0;
+    dns_lookups_failed = 0;
+    uint64_t start_ns = uv_hrtime();
+    if (spdtest_engine_resolve(dns_engine, url, on_bench_resolved, NULL) != 0) {
+        return -1.0;
+    }
+    while (dns_lookups_done == 0) {
+        uv_run(loop, UV_RUN_ONCE);
+    }
+    double us = (uv_hrtime() - start_ns) / 1e3;
+    return dns_lookups_failed > 0 ? -1.0 : us;
+}
+
+static void op_cached_resolve(void *ctx, long long ops) {
+    for (long long i = 0; i < ops; ++i) {
+        spdtest_engine_resolve(ctx, "http://cached.bench.test/", on_bench_resolved, NULL);
+    }
+}
+
+static void run_dns_benchmark(void) {
+    spdtest_engine_t *dns_engine = spdtest_engine_create(loop, NULL);
+    if (!dns_engine || start_dns_server() != 0) {
+        fprintf(stderr, "Error: Failed to start the DNS benchmark.\n");
+        exit(1);
+    }
+    char servers[64];
+    snprintf(servers, sizeof(servers), "127.0.0.1:%d", dns_server_port);
+    int rc = spdtest_engine_set_dns_servers(dns_engine, servers);
+    if (rc != 0) {
+        if (rc == UV_ENOTSUP) {
+            printf("DNS benchmark skipped: the engine is built without c-ares.\n\n");
+        } else {
+            fprintf(stderr, "Error: Cannot use the stand-in resolver: %s\n", uv_strerror(rc));
+            bench_failures++;
+        }
+        spdtest_engine_destroy(dns_engine);
+        stop_dns_server();
+        return;
+    }
+    int lookups = BENCH_DNS_LOOKUPS;
+    printf("DNS benchmark (%d lookups of distinct names against a stand-in resolver on loopback):\n", lookups);
+
+    // Cache hits answer before spdtest_engine_resolve returns. Timed first, with one name cached
+    // as in a speed test, rather than behind the thousands the lookups below leave in the cache.
+    if (timed_lookup(dns_engine, "http://cached.bench.test/") < 0.0) {
+        fprintf(stderr, "Error: DNS lookup through the stand-in resolver failed.\n");
+        bench_failures++;
+        spdtest_engine_destroy(dns_engine);
+        stop_dns_server();
+        return;
+    }
+    run_micro("dns cache hit", op_cached_resolve, dns_engine, BENCH_DNS_CACHED_LOOKUPS, 0.0);
+
+    // Every lookup uses a new name, so each one goes to the resolver (an A and an AAAA query)
+    char url[128];
+    double latency_us[BENCH_DNS_LOOKUPS];
+    int ok = 0;
+    for (int i = 0; i < lookups; ++i) {
+        snprintf(url, sizeof(url), "http://s%d.bench.test/", i);
+        double us = timed_lookup(dns_engine, url);
+        if (us >= 0.0) {
+            latency_us[ok++] = us;
+        }
+    }
+    if (ok == 0) {
+        fprintf(stderr, "Error: No DNS lookup succeeded.\n");
+        bench_failures++;
+        spdtest_engine_destroy(dns_engine);
+        stop_dns_server();
+        return;
+    }
+    qsort(latency_us, ok, sizeof(double), compare_doubles);
+    double p50 = latency_us[ok / 2];
+    double p90 = latency_us[(int)(ok * 0.90)];
+    double p99 = latency_us[(int)(ok * 0.99)];
+    printf("  %-28s p50 %7.1f us  p90 %7.1f us  p99 %7.1f us  max %7.1f us", "dns lookup", p50, p90, p99, latency_us[ok - 1]);
+    if (ok < lookups) {
+        printf("  (%d failed)", lookups - ok);
+    }
+    printf("\n");
+    add_metric("dns.lookup_p50_us", p50, "us", 0, 0);
+    add_metric("dns.lookup_p99_us", p99, "us", 0, 1);
+
+    // The same number of lookups, BENCH_DNS_CONCURRENCY of them in flight at a time
+    dns_lookups_done = 0;
+    dns_lookups_failed = 0;
+    int started = 0;
+    uint64_t start_ns = uv_hrtime();
+    while (dns_lookups_done < lookups) {
+        while (started < lookups && started - dns_lookups_done < BENCH_DNS_CONCURRENCY) {
+            snprintf(url, sizeof(url), "http://c%d.bench.test/", started++);
+            if (spdtest_engine_resolve(dns_engine, url, on_bench_resolved, NULL) != 0) {
+                dns_lookups_done++;
+                dns_lookups_failed++;
+            }
+        }
+        uv_run(loop, UV_RUN_ONCE);
+    }
+    double burst_s = (uv_hrtime() - start_ns) / 1e9;
+    double lookups_per_s = (started - dns_lookups_failed) / burst_s;
+    printf("  %-28s %10.0f lookups/s with %d in flight", "dns concurrent", lookups_per_s, BENCH_DNS_CONCURRENCY);
+    if (dns_lookups_failed > 0) {
+        printf("  (%d failed)", dns_lookups_failed);
+    }
+    printf("\n");
+    add_metric("dns.lookups_per_s", lookups_per_s, "lookups/s", 1, 0);
+
+    spdtest_engine_destroy(dns_engine);
+    uv_run(loop, UV_RUN_NOWAIT);
+    stop_dns_server();
+    printf("\n");
+}
+// --- End DNS benchmark ---
+
+// --- Baseline ---
+// One "name value" line per metric. A metric is a regression when it is worse than the baseline
+// by more than the threshold, or missing from this run (its benchmark failed or was not run);
+// the exit status is 1 when any metric regressed.
+
+static int save_baseline(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot write baseline %s\n", path);
+        return -1;
+    }
+    for (int i = 0; i < bench_num_results; ++i) {
+        fprintf(file, "%s %.6f\n", bench_results[i].name, bench_results[i].value);
+    }
+    fclose(file);
+    printf("Baseline saved to %s (%d metrics).\n", path, bench_num_results);
+    return 0;
+}
+
+static int compare_baseline(const char *path, double threshold_pct) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot read baseline %s\n", path);
+        return -1;
+    }
+    printf("Comparison with %s (threshold %.1f%%):\n", path, threshold_pct);
+    int regressions = 0;
+    int missing = 0;
+    char name[64];
+    double baseline;
+    while (fscanf(file, "%63s %lf", name, &baseline) == 2) {
+        const bench_metric_t *metric = NULL;
+        for (int i = 0; i < bench_num_results; ++i) {
+            if (strcmp(bench_results[i].name, name) == 0) {
+                metric = &bench_results[i];
+            }
+        }
+        if (!metric) {
+            printf("  %-40s %12.3f -> %12s %-12s %8s  MISSING\n", name, baseline, "-", "", "");
+            missing++;
+            continue;
+        }
+        if (baseline <= 0.0) {
+            continue;
+        }
+        double change_pct = (metric->value - baseline) / baseline * 100.0;
+        double worse_pct = metric->higher_is_better ? -change_pct : change_pct;
+        const char *verdict = "ok";
+        if (metric->informational) {
+            verdict = "info";
+        } else if (worse_pct > threshold_pct) {
+            verdict = "REGRESSION";
+            regressions++;
+        }
+        printf("  %-40s %12.3f -> %12.3f %-12s %+7.1f%%  %s\n", name, baseline, metric->value, metric->unit, change_pct, verdict);
+    }
+    fclose(file);
+    if (missing > 0) {
+        printf("%d metric(s) of the baseline missing from this run.\n", missing);
+    }
+    if (regressions > 0) {
+        printf("%d metric(s) regressed by more than %.1f%%.\n", regressions, threshold_pct);
+    }
+    if (regressions > 0 || missing > 0) {
+        return 1;
+    }
+    printf("No regressions.\n");
+    return 0;
+}
+// --- End Baseline ---
+
+static void print_bench_usage(const char *prog_name) {
+    printf("Usage: %s [options]\n", prog_name);
+    printf("Benchmarks the libuv/libcurl bridge of the speed test client.\n");
+    printf("--micro, --macro and --dns can be combined; all three run by default.\n");
+    printf("Options:\n");
+    printf("      --micro            Run only the micro-benchmarks.\n");
+    printf("      --macro            Run only the loopback transfer benchmarks.\n");
+    printf("      --dns              Run only the DNS benchmark.\n");
+    printf("  -r, --repetitions <N>  Runs per benchmark. (Default: %d)\n", BENCH_DEFAULT_REPETITIONS);
+    printf("  -c, --connections <N>  Connections of the loopback benchmarks. (Default: %d)\n", BENCH_DEFAULT_CONNECTIONS);
+    printf("  -b, --bytes <N>        Bytes per connection, K/M/G suffixes allowed. (Default: 128M)\n");
+    printf("      --save <FILE>      Save the results as a baseline.\n");
+    printf("      --baseline <FILE>  Compare with a saved baseline; exit status 1 on a regression\n"
+           "                         or a missing metric.\n");
+    printf("      --threshold <PCT>  Allowed slowdown against the baseline. (Default: %.0f)\n", BENCH_DEFAULT_THRESHOLD_PCT);
+    printf("  -h, --help             Display this help message.\n");
+}
+
+enum {
+    OPT_BENCH_MICRO = 256,
+    OPT_BENCH_MACRO,
+    OPT_BENCH_DNS,
+    OPT_BENCH_SAVE,
+    OPT_BENCH_BASELINE,
+    OPT_BENCH_THRESHOLD
+};
+
+int main(int argc, char *argv[]) {
+    bench_config.repetitions = BENCH_DEFAULT_REPETITIONS;
+    bench_config.connections = BENCH_DEFAULT_CONNECTIONS;
+    bench_config.bytes_per_connection = BENCH_DEFAULT_BYTES_PER_CONNECTION;
+    bench_config.run_micro = 1;
+    bench_config.run_macro = 1;
+    bench_config.run_dns = 1;
+    bench_config.threshold_pct = BENCH_DEFAULT_THRESHOLD_PCT;
+
+    static struct option long_options[] = {
+        {"micro", no_argument, 0, OPT_BENCH_MICRO},
+        {"macro", no_argument, 0, OPT_BENCH_MACRO},
+        {"dns", no_argument, 0, OPT_BENCH_DNS},
+        {"repetitions", required_argument, 0, 'r'},
+        {"connections", required_argument, 0, 'c'},
+        {"bytes", required_argument, 0, 'b'},
+        {"save", required_argument, 0, OPT_BENCH_SAVE},
+        {"baseline", required_argument, 0, OPT_BENCH_BASELINE},
+        {"threshold", required_argument, 0, OPT_BENCH_THRESHOLD},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:c:b:h", long_options, NULL)) != -1) {
+        if ((opt == OPT_BENCH_MICRO || opt == OPT_BENCH_MACRO || opt == OPT_BENCH_DNS) && !bench_config.modes_selected) {
+            bench_config.modes_selected = 1;
+            bench_config.run_micro = 0;
+            bench_config.run_macro = 0;
+            bench_config.run_dns = 0;
+        }
+        switch (opt) {
+            case OPT_BENCH_MICRO:
+                bench_config.run_micro = 1;
+                break;
+            case OPT_BENCH_MACRO:
+                bench_config.run_macro = 1;
+                break;
+            case OPT_BENCH_DNS:
+                bench_config.run_dns = 1;
+                break;
+            case 'r':
+                bench_config.repetitions = atoi(optarg);
+                if (bench_config.repetitions < 1) {
+                    fprintf(stderr, "Error: At least one repetition is needed.\n");
+                    return 1;
+                }
+                break;
+            case 'c':
+                bench_config.connections = atoi(optarg);
+                if (bench_config.connections < 1 || bench_config.connections > SPEEDTEST_MAX_CONNECTIONS) {
+                    fprintf(stderr, "Error: Connections must be between 1 and %d.\n", SPEEDTEST_MAX_CONNECTIONS);
+                    return 1;
+                }
+                break;
+            case 'b':
+                if (speedtest_parse_size(optarg, &bench_config.bytes_per_connection) != 0 ||
+                    bench_config.bytes_per_connection < 1) {
+                    fprintf(stderr, "Error: Invalid byte count '%s'.\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_BENCH_SAVE:
+                bench_config.save_path = optarg;
+                break;
+            case OPT_BENCH_BASELINE:
+                bench_config.baseline_path = optarg;
+                break;
+            case OPT_BENCH_THRESHOLD:
+                bench_config.threshold_pct = atof(optarg);
+                if (bench_config.threshold_pct <= 0.0) {
+                    fprintf(stderr, "Error: The threshold must be a positive percentage.\n");
+                    return 1;
+                }
+                break;
+            case 'h':
+                print_bench_usage(argv[0]);
+                return 0;
+            default:
+                print_bench_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    // The engine as the speed test client sets it up, without retries: a failed transfer is a
+    // benchmark error, not something to hide
+    loop = uv_default_loop();
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK || !(engine = speedtest_client_init(loop, bench_config.connections))) {
+        fprintf(stderr, "Error: Failed to initialize libcurl.\n");
+        return 1;
+    }
+    calibrate_cycle_counter();
+    if (cycles_per_ns > 0.0) {
+        printf("Cycle counter: %.3f GHz\n\n", cycles_per_ns);
+    }
+
+    if (bench_config.run_micro) {
+        run_micro_benchmarks();
+    }
+    if (bench_config.run_macro) {
+        run_macro_benchmarks();
+    }
+    if (bench_config.run_dns) {
+        run_dns_benchmark();
+    }
+
+    int status = 0;
+    if (bench_failures > 0) {
+        fprintf(stderr, "Error: %d benchmark(s) failed.\n", bench_failures);
+        status = 1;
+    }
+    if (bench_config.save_path && save_baseline(bench_config.save_path) != 0) {
+        status = 1;
+    }
+    if (bench_config.baseline_path && compare_baseline(bench_config.baseline_path, bench_config.threshold_pct) != 0) {
+        status = 1;
+    }
+
+    speedtest_client_cleanup();
+    curl_global_cleanup();
+    uv_run(loop, UV_RUN_NOWAIT);
+    uv_loop_close(loop);
+    return status;
+}
@@ -1,163 +1,506 @@
-#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 #include <uv.h>
 #include <curl/curl.h>
+#include "spdtest.h"
 
-uv_loop_t *loop;
-CURLM *curl_handle;
-uv_timer_t timeout;
+/* Committed bytes are recorded in the state file every STATE_SAVE_INTERVAL bytes */
+#define STATE_SAVE_INTERVAL (4 * 1024 * 1024)
 
-typedef struct curl_context_s
-{
-  uv_poll_t poll_handle;
-  curl_socket_t sockfd;
-} curl_context_t;
+/* A download that fails with a transient error is resumed after an exponential backoff with jitter */
+#define MAX_RETRIES 5
+#define RETRY_BASE_DELAY_MS 500
+#define RETRY_MAX_DELAY_MS 30000
 
-curl_context_t *create_curl_context(curl_socket_t sockfd)
+/* Progress of the running downloads is printed every PROGRESS_INTERVAL_MS */
+#define PROGRESS_INTERVAL_MS 1000
+
+uv_loop_t *loop;
+spdtest_engine_t *engine;     /* polls the sockets and runs the transfers on loop */
+
+/*
+ * A download keeps its progress in a sidecar state file next to the output ("1.download.state"):
+ * the URL, the validator of the resource (ETag or Last-Modified) and the number of bytes that
+ * were written and flushed to the output. A rerun after a failure truncates the output to that
+ * length and asks for the rest with a Range request. If-Range makes the server send the whole
+ * resource instead (200) when it changed, and the output then starts over.
+ */
+typedef struct download_s
 {
-  curl_context_t *context;
+  char url[2048];
+  char filename[50];
+  char state_filename[64];
+  CURL *handle;
+  FILE *file;
+  curl_off_t committed;       /* bytes written to the file and recorded as valid */
+  curl_off_t last_saved;      /* committed value in the state file */
+  curl_off_t resume_from;     /* offset requested with Range, 0 for a full download */
+  char etag[256];             /* validator of the content in the file */
+  char last_modified[64];
+  char response_etag[256];    /* validator of the response being received */
+  char response_last_modified[64];
+  curl_off_t response_total;  /* complete length from Content-Range, -1 if not sent */
+  int body_started;
+  struct curl_slist *headers;
+  uv_timer_t retry_timer;
+  int attempts;               /* retries used so far */
+} download_t;
+
+void save_download_state(download_t *download)
+{
+  char tmp_filename[70];
+  sprintf(tmp_filename, "%s.tmp", download->state_filename);
+  FILE *state = fopen(tmp_filename, "w");
+  if (state == NULL)
+  {
+    fprintf(stderr, "Error opening %s\n", tmp_filename);
+    return;
+  }
+  fprintf(state, "url %s\n", download->url);
+  if (download->etag[0])
+    fprintf(state, "etag %s\n", download->etag);
+  if (download->last_modified[0])
+    fprintf(state, "last-modified %s\n", download->last_modified);
+  fprintf(state, "committed %lld\n", (long long) download->committed);
+  if (fclose(state) != 0 || rename(tmp_filename, download->state_filename) != 0)
+  {
+    fprintf(stderr, "Error writing %s\n", download->state_filename);
+    return;
+  }
+  download->last_saved = download->committed;
+}
 
-  context = (curl_context_t *) malloc(sizeof *context);
+/* Copies a validator from the state file. One that does not fit is dropped rather than
+   truncated, a truncated validator would never match If-Range. */
+void copy_validator(char *out, size_t out_size, const char *value)
+{
+  size_t len = strlen(value);
+  if (len >= out_size)
+    len = 0;
+  memcpy(out, value, len);
+  out[len] = '\0';
+}
 
-  context->sockfd = sockfd;
+/* Returns 1 if the state file belongs to this URL and has a usable validator */
+int load_download_state(download_t *download)
+{
+  FILE *state = fopen(download->state_filename, "r");
+  if (state == NULL)
+    return 0;
 
-  int r = uv_poll_init_socket(loop, &context->poll_handle, sockfd);
-  assert(r == 0);
-  context->poll_handle.data = context;
+  char line[2400];
+  int same_url = 0;
+  long long committed = 0;
+  while (fgets(line, sizeof line, state))
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strncmp(line, "url ", 4) == 0)
+      same_url = strcmp(line + 4, download->url) == 0;
+    else if (strncmp(line, "etag ", 5) == 0)
+      copy_validator(download->etag, sizeof download->etag, line + 5);
+    else if (strncmp(line, "last-modified ", 14) == 0)
+      copy_validator(download->last_modified, sizeof download->last_modified, line + 14);
+    else if (strncmp(line, "committed ", 10) == 0)
+      committed = atoll(line + 10);
+  }
+  fclose(state);
 
-  return context;
+  /* A weak ETag cannot be used with If-Range, Last-Modified still can */
+  if (strncmp(download->etag, "W/", 2) == 0)
+    download->etag[0] = '\0';
+  if (!same_url || committed <= 0 || (!download->etag[0] && !download->last_modified[0]))
+  {
+    download->etag[0] = '\0';
+    download->last_modified[0] = '\0';
+    return 0;
+  }
+  download->committed = committed;
+  return 1;
 }
 
-void curl_close_cb(uv_handle_t *handle)
+/* Copies the value of a "Name: value" header if it has the given name. A value that does not
+   fit is copied as empty: the validators are only useful intact. */
+int copy_header_value(const char *header, size_t size, const char *name, char *out, size_t out_size)
 {
-  curl_context_t *context = (curl_context_t *) handle->data;
-  free(context);
+  size_t name_len = strlen(name);
+  if (size <= name_len || strncasecmp(header, name, name_len) != 0)
+    return 0;
+  const char *value = header + name_len;
+  size_t len = size - name_len;
+  while (len > 0 && (*value == ' ' || *value == '\t'))
+  {
+    value++;
+    len--;
+  }
+  while (len > 0 && (value[len - 1] == '\r' || value[len - 1] == '\n' || value[len - 1] == ' '))
+    len--;
+  if (len >= out_size)
+  {
+    fprintf(stderr, "Ignoring %.*s header of %zu bytes, too long to resume with\n", (int) name_len - 1, name, len);
+    len = 0;
+  }
+  memcpy(out, value, len);
+  out[len] = '\0';
+  return 1;
 }
 
-void destroy_curl_context(curl_context_t *context)
+size_t download_header_cb(char *buffer, size_t size, size_t nitems, void *userdata)
 {
-  uv_close((uv_handle_t *) &context->poll_handle, curl_close_cb);
+  download_t *download = (download_t *) userdata;
+  size_t len = size * nitems;
+
+  if (len > 5 && strncmp(buffer, "HTTP/", 5) == 0)
+  {
+    /* A new response (redirect or final): forget validators of the previous one */
+    download->response_etag[0] = '\0';
+    download->response_last_modified[0] = '\0';
+    download->response_total = -1;
+  }
+  else if (len > 14 && strncasecmp(buffer, "Content-Range:", 14) == 0)
+  {
+    /* "bytes 0-99/1000" on a 206, a "*" range on a 416, the complete length after the slash */
+    const char *total = memchr(buffer, '/', len);
+    if (total != NULL && total[1] >= '0' && total[1] <= '9')
+      download->response_total = strtoll(total + 1, NULL, 10);
+  }
+  else if (!copy_header_value(buffer, len, "ETag:", download->response_etag, sizeof download->response_etag))
+  {
+    copy_header_value(buffer, len, "Last-Modified:", download->response_last_modified,
+                      sizeof download->response_last_modified);
+  }
+  return len;
 }
 
-void add_download(const char *url, int num)
+size_t download_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-  char filename[50];
-  sprintf(filename, "%d.download", num);
-  FILE *file;
+  download_t *download = (download_t *) userdata;
+  size_t len = size * nmemb;
 
-  file = fopen(filename, "w");
-  if (file == NULL)
+  if (!download->body_started)
   {
-    fprintf(stderr, "Error opening %s\n", filename);
-    return;
+    download->body_started = 1;
+    long response_code = 0;
+    curl_easy_getinfo(download->handle, CURLINFO_RESPONSE_CODE, &response_code);
+    if (download->resume_from > 0 && response_code != 206)
+    {
+      /* The resource changed or the server ignores ranges: start the file over */
+      fprintf(stderr, "%s: server sent the full resource (%ld), restarting %s\n", download->url, response_code,
+              download->filename);
+      if (ftruncate(fileno(download->file), 0) != 0 || fseek(download->file, 0, SEEK_SET) != 0)
+        return 0;
+      download->committed = 0;
+      download->resume_from = 0;
+    }
+    if (download->resume_from == 0)
+    {
+      /* The file now holds the content of this response */
+      snprintf(download->etag, sizeof download->etag, "%s",
+               strncmp(download->response_etag, "W/", 2) == 0 ? "" : download->response_etag);
+      snprintf(download->last_modified, sizeof download->last_modified, "%s", download->response_last_modified);
+    }
   }
 
-  CURL *handle = curl_easy_init();
-  curl_easy_setopt(handle, CURLOPT_WRITEDATA, file);
-  curl_easy_setopt(handle, CURLOPT_URL, url);
-  curl_multi_add_handle(curl_handle, handle);
-  fprintf(stderr, "Added download %s -> %s\n", url, filename);
+  if (fwrite(ptr, 1, len, download->file) != len)
+    return 0;
+  download->committed += len;
+  spdtest_engine_count_bytes(engine, len);
+
+  if (download->committed - download->last_saved >= STATE_SAVE_INTERVAL)
+  {
+    /* Only data that reached the file is recorded as committed */
+    if (fflush(download->file) == 0)
+      save_download_state(download);
+  }
+  return len;
 }
 
-void check_multi_info(void)
+/* Starts a transfer for the part of the resource that is not in the file yet */
+int start_download(download_t *download)
 {
-  char *done_url;
-  CURLMsg *message;
-  int pending;
+  if (download->committed > 0 && !download->etag[0] && !download->last_modified[0])
+  {
+    /* Nothing tells whether the resource is still the same: start over */
+    if (ftruncate(fileno(download->file), 0) != 0 || fseek(download->file, 0, SEEK_SET) != 0)
+      return -1;
+    download->committed = 0;
+  }
+  download->resume_from = download->committed;
+  download->body_started = 0;
+  download->response_etag[0] = '\0';
+  download->response_last_modified[0] = '\0';
+  download->response_total = -1;
+  curl_slist_free_all(download->headers);
+  download->headers = NULL;
 
-  while ((message = curl_multi_info_read(curl_handle, &pending)))
+  CURL *handle = curl_easy_init();
+  if (handle == NULL)
+    return -1;
+  download->handle = handle;
+  curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, download_write_cb);
+  curl_easy_setopt(handle, CURLOPT_WRITEDATA, download);
+  curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, download_header_cb);
+  curl_easy_setopt(handle, CURLOPT_HEADERDATA, download);
+  curl_easy_setopt(handle, CURLOPT_PRIVATE, download);
+  curl_easy_setopt(handle, CURLOPT_URL, download->url);
+  spdtest_engine_pin_resolve(engine, handle, download->url);
+  curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+  if (download->resume_from > 0)
   {
-    switch (message->msg)
-    {
-    case CURLMSG_DONE:
-      curl_easy_getinfo(message->easy_handle, CURLINFO_EFFECTIVE_URL, &done_url);
-      printf("%s DONE\n", done_url);
+    /* Range via CURLOPT_RANGE rather than CURLOPT_RESUME_FROM_LARGE: libcurl fails the transfer
+       on a 200 answer to the latter, and a 200 is what If-Range sends for a changed resource */
+    char range[32];
+    char if_range[300];
+    sprintf(range, "%lld-", (long long) download->resume_from);
+    curl_easy_setopt(handle, CURLOPT_RANGE, range);
+    snprintf(if_range, sizeof if_range, "If-Range: %s", download->etag[0] ? download->etag : download->last_modified);
+    download->headers = curl_slist_append(NULL, if_range);
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, download->headers);
+    fprintf(stderr, "Resuming download %s -> %s at %lld bytes\n", download->url, download->filename,
+            (long long) download->resume_from);
+  }
+  else
+  {
+    fprintf(stderr, "%s download %s -> %s\n", download->attempts > 0 ? "Restarting" : "Added", download->url,
+            download->filename);
+  }
+  if (spdtest_engine_add(engine, handle) != CURLM_OK)
+  {
+    curl_easy_cleanup(handle);
+    download->handle = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void free_download(uv_handle_t *handle)
+{
+  download_t *download = (download_t *) handle->data;
+  curl_slist_free_all(download->headers);
+  free(download);
+}
 
-      curl_multi_remove_handle(curl_handle, message->easy_handle);
-      curl_easy_cleanup(message->easy_handle);
-      break;
+void finish_download(download_t *download, CURLcode result)
+{
+  if (fflush(download->file) != 0 && result == CURLE_OK)
+    result = CURLE_WRITE_ERROR;
+  fclose(download->file);
 
-    default:
-      fprintf(stderr, "CURLMSG default\n");
-      abort();
-    }
+  if (result == CURLE_OK)
+  {
+    remove(download->state_filename);
+  }
+  else
+  {
+    save_download_state(download);
+    fprintf(stderr, "%s FAILED: %s after %d retries, %lld bytes kept in %s, run again to resume\n", download->url,
+            curl_easy_strerror(result), download->attempts, (long long) download->committed, download->filename);
   }
+  uv_close((uv_handle_t *) &download->retry_timer, free_download);
 }
 
-void curl_perform(uv_poll_t *req, int status, int events)
+/* Whether a failed transfer may succeed when tried again */
+int is_transient_failure(CURLcode result, long response_code)
 {
-  uv_timer_stop(&timeout);
-  int running_handles;
-  int flags = 0;
-  if (status < 0)
-    flags = CURL_CSELECT_ERR;
-  if (!status && events & UV_READABLE)
-    flags |= CURL_CSELECT_IN;
-  if (!status && events & UV_WRITABLE)
-    flags |= CURL_CSELECT_OUT;
+  switch (result)
+  {
+  case CURLE_HTTP_RETURNED_ERROR:
+    return response_code == 408 || response_code == 425 || response_code == 429 || response_code == 500 ||
+           response_code == 502 || response_code == 503 || response_code == 504;
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_OPERATION_TIMEDOUT:
+  case CURLE_PARTIAL_FILE:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+  case CURLE_GOT_NOTHING:
+  case CURLE_SSL_CONNECT_ERROR:
+  case CURLE_HTTP2:
+  case CURLE_HTTP2_STREAM:
+  case CURLE_HTTP3:
+  case CURLE_QUIC_CONNECT_ERROR:
+    return 1;
+  default:
+    /* A bad URL, a 404 or a full disk will not go away by waiting */
+    return 0;
+  }
+}
 
-  curl_context_t *context;
+/* Exponential backoff, half of it random so that downloads failing together do not retry together */
+uint64_t retry_delay_ms(int attempt, curl_off_t retry_after_s)
+{
+  uint64_t delay = RETRY_BASE_DELAY_MS;
+  for (int i = 1; i < attempt && delay < RETRY_MAX_DELAY_MS; i++)
+    delay *= 2;
+  if (delay > RETRY_MAX_DELAY_MS)
+    delay = RETRY_MAX_DELAY_MS;
+  delay = delay / 2 + (uint64_t) rand() % (delay / 2 + 1);
+  /* Honor Retry-After of a 429/503, within the cap */
+  if (retry_after_s > 0 && (uint64_t) retry_after_s * 1000 > delay)
+    delay = (uint64_t) retry_after_s * 1000 < RETRY_MAX_DELAY_MS ? (uint64_t) retry_after_s * 1000 : RETRY_MAX_DELAY_MS;
+  return delay;
+}
 
-  context = (curl_context_t *) req;
+/* Starts the download once the engine has resolved its host, so libcurl does not block on DNS */
+void on_host_resolved(spdtest_engine_t *engine, const spdtest_dns_result_t *result, void *userp)
+{
+  download_t *download = (download_t *) userp;
+  if (result->status == UV_ECANCELED)
+  {
+    finish_download(download, CURLE_ABORTED_BY_CALLBACK);
+    return;
+  }
+  /* A failed lookup is left to libcurl, which reports it like any other transfer error */
+  if (result->status != 0)
+    fprintf(stderr, "DNS lookup for %s failed: %s\n", result->host, uv_strerror(result->status));
+  if (start_download(download) != 0)
+    finish_download(download, CURLE_FAILED_INIT);
+}
 
-  curl_multi_socket_action(curl_handle, context->sockfd, flags, &running_handles);
-  check_multi_info();
+void resolve_and_start(download_t *download)
+{
+  if (spdtest_engine_resolve(engine, download->url, on_host_resolved, download) != 0 && start_download(download) != 0)
+    finish_download(download, CURLE_FAILED_INIT);
 }
 
-void on_timeout(uv_timer_t *req)
+void on_retry_timer(uv_timer_t *req)
 {
-  int running_handles;
-  curl_multi_socket_action(curl_handle, CURL_SOCKET_TIMEOUT, 0, &running_handles);
-  check_multi_info();
+  resolve_and_start((download_t *) req->data);
 }
 
-void start_timeout(CURLM *multi, long timeout_ms, void *userp)
+void schedule_retry(download_t *download, CURLcode result, curl_off_t retry_after_s)
 {
-  if (timeout_ms <= 0)
-    timeout_ms = 1; /* 0 means directly call socket_action, but we'll do it in a bit */
-  uv_timer_start(&timeout, on_timeout, timeout_ms, 0);
+  /* The retry continues from what reached the file; record it in case we get killed meanwhile */
+  if (fflush(download->file) != 0)
+  {
+    finish_download(download, CURLE_WRITE_ERROR);
+    return;
+  }
+  save_download_state(download);
+  download->attempts++;
+  uint64_t delay = retry_delay_ms(download->attempts, retry_after_s);
+  fprintf(stderr, "%s: %s, retry %d/%d in %llu ms\n", download->url, curl_easy_strerror(result), download->attempts,
+          MAX_RETRIES, (unsigned long long) delay);
+  uv_timer_start(&download->retry_timer, on_retry_timer, delay, 0);
 }
 
-int handle_socket(CURL *easy, curl_socket_t s, int action, void *userp, void *socketp)
+void add_download(const char *url, int num)
 {
-  curl_context_t *curl_context;
-  if (action == CURL_POLL_IN || action == CURL_POLL_OUT)
+  download_t *download = (download_t *) calloc(1, sizeof *download);
+  if (download == NULL)
   {
-    if (socketp)
+    fprintf(stderr, "Error allocating download %d\n", num);
+    return;
+  }
+  snprintf(download->url, sizeof download->url, "%s", url);
+  sprintf(download->filename, "%d.download", num);
+  sprintf(download->state_filename, "%s.state", download->filename);
+
+  FILE *file = NULL;
+  if (load_download_state(download))
+  {
+    file = fopen(download->filename, "r+b");
+    if (file != NULL)
     {
-      curl_context = (curl_context_t *) socketp;
+      off_t size = fseeko(file, 0, SEEK_END) == 0 ? ftello(file) : -1;
+      if (size < download->committed)
+      {
+        /* The file lost data the state claims: do not trust either */
+        fclose(file);
+        file = NULL;
+      }
+      else if (ftruncate(fileno(file), download->committed) != 0 || fseek(file, 0, SEEK_END) != 0)
+      {
+        fclose(file);
+        file = NULL;
+      }
     }
-    else
+    if (file == NULL)
     {
-      curl_context = create_curl_context(s);
-      curl_multi_assign(curl_handle, s, (void *) curl_context);
+      download->committed = 0;
+      download->etag[0] = '\0';
+      download->last_modified[0] = '\0';
     }
   }
-
-  switch (action)
+  if (file == NULL)
+    file = fopen(download->filename, "wb");
+  if (file == NULL)
   {
-  case CURL_POLL_IN:
-    uv_poll_start(&curl_context->poll_handle, UV_READABLE, curl_perform);
-    break;
-  case CURL_POLL_OUT:
-    uv_poll_start(&curl_context->poll_handle, UV_WRITABLE, curl_perform);
-    break;
-  case CURL_POLL_REMOVE:
-    if (socketp)
-    {
-      uv_poll_stop(&((curl_context_t *) socketp)->poll_handle);
-      destroy_curl_context((curl_context_t *) socketp);
-      curl_multi_assign(curl_handle, s, NULL);
-    }
-    break;
-  default:
-    abort();
+    fprintf(stderr, "Error opening %s\n", download->filename);
+    free(download);
+    return;
   }
+  download->file = file;
+  download->last_saved = download->committed;
+  uv_timer_init(loop, &download->retry_timer);
+  download->retry_timer.data = download;
 
+  resolve_and_start(download);
+}
+
+/* A 416 to a resume request means the file already ends where the resource does, e.g. after a
+   kill right after the last state save. Returns 1 if the length the server reports confirms that. */
+int is_complete_range(download_t *download, CURLcode result, long response_code)
+{
+  if (result != CURLE_HTTP_RETURNED_ERROR || response_code != 416 || download->resume_from <= 0)
+    return 0;
+  if (download->response_total == download->committed)
+    return 1;
+  if (download->response_total < 0)
+    fprintf(stderr, "%s: range %lld- not satisfiable, length unknown\n", download->url,
+            (long long) download->resume_from);
+  else
+    fprintf(stderr, "%s: range %lld- not satisfiable, resource has %lld bytes\n", download->url,
+            (long long) download->resume_from, (long long) download->response_total);
   return 0;
 }
 
+int on_transfer_done(spdtest_engine_t *engine, CURL *easy, CURLcode result, void *userp)
+{
+  char *done_url;
+  download_t *download;
+  long response_code = 0;
+  curl_off_t retry_after_s = 0;
+  curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &done_url);
+  curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **) &download);
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &response_code);
+  curl_easy_getinfo(easy, CURLINFO_RETRY_AFTER, &retry_after_s);
+  if (is_complete_range(download, result, response_code))
+    result = CURLE_OK;
+  if (result == CURLE_OK && download->attempts > 0)
+    printf("%s DONE after %d retries\n", done_url, download->attempts);
+  else if (result == CURLE_OK)
+    printf("%s DONE\n", done_url);
+
+  /* The engine has removed the handle; a retry starts with a new one */
+  curl_easy_cleanup(easy);
+  download->handle = NULL;
+  if (result == CURLE_HTTP_RETURNED_ERROR && response_code == 416 && download->resume_from > 0 &&
+      download->attempts < MAX_RETRIES)
+  {
+    /* The file does not match the resource any more: without validators start_download
+       truncates it and fetches the resource whole */
+    download->etag[0] = '\0';
+    download->last_modified[0] = '\0';
+    download->attempts++;
+    resolve_and_start(download);
+  }
+  else if (result != CURLE_OK && is_transient_failure(result, response_code) && download->attempts < MAX_RETRIES)
+    schedule_retry(download, result, retry_after_s);
+  else
+    finish_download(download, result);
+  return SPDTEST_TRANSFER_DONE;
+}
+
+void on_progress(spdtest_engine_t *engine, const spdtest_progress_t *progress, void *userp)
+{
+  fprintf(stderr, "%d downloads running, %.1f MB in %.0f s, %.1f Mbit/s\n", progress->running_transfers,
+          progress->bytes / 1e6, progress->elapsed_s, progress->interval_mbps);
+}
+
 int main(int argc, char **argv)
 {
   loop = uv_default_loop();
@@ -171,18 +514,28 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  uv_timer_init(loop, &timeout);
+  srand((unsigned int) time(NULL) ^ (unsigned int) getpid());
 
-  curl_handle = curl_multi_init();
-  curl_multi_setopt(curl_handle, CURLMOPT_SOCKETFUNCTION, handle_socket);
-  curl_multi_setopt(curl_handle, CURLMOPT_TIMERFUNCTION, start_timeout);
+  spdtest_callbacks_t callbacks = {0};
+  callbacks.on_transfer_done = on_transfer_done;
+  callbacks.on_progress = on_progress;
+  callbacks.progress_interval_ms = PROGRESS_INTERVAL_MS;
+  engine = spdtest_engine_create(loop, &callbacks);
+  if (engine == NULL)
+  {
+    fprintf(stderr, "Could not create the transfer engine\n");
+    return 1;
+  }
+  spdtest_engine_start(engine);
 
   while (argc-- > 1)
   {
     add_download(argv[argc], argc);
   }
 
+  /* Runs until every download finished: retry timers keep the loop alive between attempts */
+  uv_run(loop, UV_RUN_DEFAULT);
+  spdtest_engine_destroy(engine);
   uv_run(loop, UV_RUN_DEFAULT);
-  curl_multi_cleanup(curl_handle);
   return 0;
 }
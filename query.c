@@ -0,0 +1,602 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // timegm
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "resultlog.h"
+
+// Query tool for the binary result log of speedtest --log (see resultlog.h). The log is mapped
+// and read in place, slot by slot, without parsing anything:
+//
+//   percentiles  of the test results, or of their interval samples, over a time range
+//   --bucket     count, mean, min and max per time bucket
+//
+// Every block of RESULTLOG_INDEX_EVERY results is checked against its index slot first, so blocks
+// outside the range, or without a result of the kind, are skipped without touching their
+// records; in bucket mode a block that lies inside one bucket is taken from its index summary.
+// Percentiles use the nearest rank, found by quickselect. Times are UTC.
+
+#define DEFAULT_PERCENTILES "5,25,50,75,95"
+#define MAX_PERCENTILES 16
+#define MAX_BUCKETS 1000000
+
+typedef struct {
+    const unsigned char *base;
+    size_t size;
+    long long num_slots;
+} result_log_t;
+
+typedef struct {
+    int kind; // RESULTLOG_DOWNLOAD, RESULTLOG_UPLOAD or RESULTLOG_LATENCY
+    int64_t from_us; // Inclusive, INT64_MIN without --from
+    int64_t to_us; // Exclusive, INT64_MAX without --to
+    int use_samples; // Interval samples (or latency probes) instead of one value per test
+    double percentiles[MAX_PERCENTILES];
+    int num_percentiles;
+    int64_t bucket_us; // 0 without --bucket
+} query_t;
+
+// Values gathered for the percentiles. float halves the memory of long sample series and keeps
+// more precision than the samples have.
+typedef struct {
+    float *values;
+    size_t count;
+    size_t capacity;
+} value_list_t;
+
+// Scan counters, printed so a slow query shows why
+typedef struct {
+    long long records_scanned;
+    long long blocks_skipped;
+    long long blocks_summarized;
+} scan_stats_t;
+
+static const char *kind_names[] = {"", "download", "upload", "latency"};
+static const char *kind_units[] = {"", "Mbps", "Mbps", "ms"};
+
+// --- Log Access ---
+static int open_result_log(const char *path, result_log_t *log) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < RESULTLOG_HEADER_SIZE) {
+        fprintf(stderr, "Error: %s is not a result log.\n", path);
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    const resultlog_header_t *header = base;
+    if (memcmp(header->magic, RESULTLOG_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "Error: %s is not a result log.\n", path);
+        munmap(base, (size_t)st.st_size);
+        return -1;
+    }
+    if (header->byte_order != RESULTLOG_BYTE_ORDER) {
+        fprintf(stderr, "Error: %s was written on a host of the other byte order.\n", path);
+        munmap(base, (size_t)st.st_size);
+        return -1;
+    }
+    if (header->version != RESULTLOG_VERSION || header->header_size != RESULTLOG_HEADER_SIZE ||
+        header->record_size != RESULTLOG_RECORD_SIZE || header->index_every != RESULTLOG_INDEX_EVERY ||
+        header->max_samples != RESULTLOG_MAX_SAMPLES) {
+        fprintf(stderr, "Error: %s is a result log of another version (%u).\n", path, header->version);
+        munmap(base, (size_t)st.st_size);
+        return -1;
+    }
+    // Sequential scans: let the kernel read ahead
+    madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+    log->base = base;
+    log->size = (size_t)st.st_size;
+    log->num_slots = (long long)(log->size - RESULTLOG_HEADER_SIZE) / RESULTLOG_RECORD_SIZE; // A torn last slot is ignored
+    return 0;
+}
+
+static const void *log_slot(const result_log_t *log, long long slot) {
+    return log->base + RESULTLOG_HEADER_SIZE + slot * RESULTLOG_RECORD_SIZE;
+}
+
+// Index slot of the block starting at first_slot, NULL while the block is still being filled
+static const resultlog_index_t *block_index(const result_log_t *log, long long first_slot) {
+    long long slot = first_slot + RESULTLOG_INDEX_EVERY;
+    if (slot >= log->num_slots) {
+        return NULL;
+    }
+    const resultlog_index_t *index = log_slot(log, slot);
+    return index->kind == RESULTLOG_INDEX ? index : NULL;
+}
+
+// Result slots of the block starting at first_slot
+static long long block_end(const result_log_t *log, long long first_slot) {
+    long long end = first_slot + RESULTLOG_INDEX_EVERY;
+    return end < log->num_slots ? end : log->num_slots;
+}
+
+// The block has no result of the kind in the range; blocks without an index are never skipped
+static int block_skippable(const resultlog_index_t *index, const query_t *query) {
+    return index && (index->kinds[query->kind - 1].count == 0 || index->max_timestamp_us < query->from_us ||
+                     index->min_timestamp_us >= query->to_us);
+}
+
+// Results flagged RESULTLOG_FLAG_NO_DATA have no value to aggregate and never match
+static int record_matches(const resultlog_record_t *record, const query_t *query) {
+    return record->kind == (uint32_t)query->kind && !(record->flags & RESULTLOG_FLAG_NO_DATA) &&
+           record->timestamp_us >= query->from_us && record->timestamp_us < query->to_us;
+}
+// --- End Log Access ---
+
+// --- Percentiles ---
+static int append_value(value_list_t *list, float value) {
+    if (list->count == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 4096;
+        float *grown = realloc(list->values, new_capacity * sizeof(float));
+        if (!grown) {
+            return -1;
+        }
+        list->values = grown;
+        list->capacity = new_capacity;
+    }
+    list->values[list->count++] = value;
+    return 0;
+}
+
+// Moves the k-th smallest of values[lo, hi) to values[k], smaller ones before it and larger ones
+// after it (Hoare partitioning around a median of three)
+static void select_kth(float *values, size_t lo, size_t hi, size_t k) {
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        float a = values[lo], b = values[mid], c = values[hi - 1];
+        float pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+        size_t i = lo, j = hi - 1;
+        while (i <= j) {
+            while (values[i] < pivot) {
+                i++;
+            }
+            while (values[j] > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                float tmp = values[i];
+                values[i] = values[j];
+                values[j] = tmp;
+                i++;
+                if (j == 0) {
+                    break;
+                }
+                j--;
+            }
+        }
+        // [lo, j] <= pivot <= [i, hi)
+        if (k <= j) {
+            hi = j + 1;
+        } else if (k >= i) {
+            lo = i;
+        } else {
+            return; // Between the partitions, values[k] is the pivot
+        }
+    }
+}
+
+static int compare_percentiles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int run_percentiles(const result_log_t *log, const query_t *query) {
+    value_list_t list = {NULL, 0, 0};
+    scan_stats_t scan = {0, 0, 0};
+    double sum = 0.0;
+    float min = 0.0f, max = 0.0f;
+    int64_t first_us = INT64_MAX, last_us = INT64_MIN;
+    long long tests = 0;
+
+    for (long long first = 0; first < log->num_slots; first += RESULTLOG_INDEX_EVERY + 1) {
+        if (block_skippable(block_index(log, first), query)) {
+            scan.blocks_skipped++;
+            continue;
+        }
+        long long end = block_end(log, first);
+        for (long long slot = first; slot < end; ++slot) {
+            const resultlog_record_t *record = log_slot(log, slot);
+            scan.records_scanned++;
+            if (!record_matches(record, query)) {
+                continue;
+            }
+            tests++;
+            if (record->timestamp_us < first_us) {
+                first_us = record->timestamp_us;
+            }
+            if (record->timestamp_us > last_us) {
+                last_us = record->timestamp_us;
+            }
+            uint32_t count = query->use_samples ? record->num_samples : 1;
+            if (count > RESULTLOG_MAX_SAMPLES) {
+                count = RESULTLOG_MAX_SAMPLES;
+            }
+            for (uint32_t i = 0; i < count; ++i) {
+                float value = query->use_samples ? record->samples[i] : (float)record->value;
+                if (append_value(&list, value) != 0) {
+                    fprintf(stderr, "Error: Out of memory after %zu values.\n", list.count);
+                    free(list.values);
+                    return -1;
+                }
+                if (list.count == 1 || value < min) {
+                    min = value;
+                }
+                if (list.count == 1 || value > max) {
+                    max = value;
+                }
+                sum += value;
+            }
+        }
+    }
+
+    const char *name = kind_names[query->kind];
+    const char *unit = kind_units[query->kind];
+    if (list.count == 0) {
+        printf("No %s results in the range.\n", name);
+    } else {
+        char first_text[32], last_text[32];
+        time_t first_s = (time_t)(first_us / 1000000), last_s = (time_t)(last_us / 1000000);
+        strftime(first_text, sizeof(first_text), "%Y-%m-%d %H:%M:%S", gmtime(&first_s));
+        strftime(last_text, sizeof(last_text), "%Y-%m-%d %H:%M:%S", gmtime(&last_s));
+        printf("%s: %lld test(s) from %s to %s UTC", name, tests, first_text, last_text);
+        if (query->use_samples) {
+            printf(", %zu %s", list.count, query->kind == RESULTLOG_LATENCY ? "probes" : "interval samples");
+        }
+        printf("\n");
+        printf("  mean %.2f %s, min %.2f, max %.2f\n", sum / list.count, unit, min, max);
+        // Ascending percentiles each select within what is left right of the previous one
+        size_t lo = 0;
+        printf(" ");
+        for (int i = 0; i < query->num_percentiles; ++i) {
+            double rank = query->percentiles[i] / 100.0 * list.count;
+            size_t k = rank <= 1.0 ? 0 : (size_t)(rank + 0.999999999) - 1;
+            if (k >= list.count) {
+                k = list.count - 1;
+            }
+            if (k < lo) {
+                k = lo;
+            }
+            select_kth(list.values, lo, list.count, k);
+            lo = k;
+            printf(" p%g %.2f", query->percentiles[i], list.values[k]);
+        }
+        printf(" %s\n", unit);
+    }
+    printf("Scanned %lld of %lld slots; %lld block(s) skipped by their index.\n", scan.records_scanned, log->num_slots,
+           scan.blocks_skipped);
+    free(list.values);
+    return 0;
+}
+// --- End Percentiles ---
+
+// --- Time Buckets ---
+static void add_to_summary(resultlog_summary_t *summary, double value) {
+    if (summary->count == 0 || value < summary->min) {
+        summary->min = value;
+    }
+    if (summary->count == 0 || value > summary->max) {
+        summary->max = value;
+    }
+    summary->count++;
+    summary->sum += value;
+}
+
+static void merge_summary(resultlog_summary_t *into, const resultlog_summary_t *from) {
+    if (from->count == 0) {
+        return;
+    }
+    if (into->count == 0 || from->min < into->min) {
+        into->min = from->min;
+    }
+    if (into->count == 0 || from->max > into->max) {
+        into->max = from->max;
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+}
+
+static int64_t floor_div(int64_t a, int64_t b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+// Time range of the results of the kind within the query range, from the index slots where
+// there are any. Returns 0 when there is none.
+static int matching_time_range(const result_log_t *log, const query_t *query, int64_t *first_us, int64_t *last_us) {
+    *first_us = INT64_MAX;
+    *last_us = INT64_MIN;
+    for (long long first = 0; first < log->num_slots; first += RESULTLOG_INDEX_EVERY + 1) {
+        const resultlog_index_t *index = block_index(log, first);
+        if (block_skippable(index, query)) {
+            continue;
+        }
+        if (index && index->min_timestamp_us >= query->from_us && index->max_timestamp_us < query->to_us) {
+            // Bounds of every kind, at most a few empty buckets wider than needed
+            if (index->min_timestamp_us < *first_us) {
+                *first_us = index->min_timestamp_us;
+            }
+            if (index->max_timestamp_us > *last_us) {
+                *last_us = index->max_timestamp_us;
+            }
+            continue;
+        }
+        long long end = block_end(log, first);
+        for (long long slot = first; slot < end; ++slot) {
+            const resultlog_record_t *record = log_slot(log, slot);
+            if (!record_matches(record, query)) {
+                continue;
+            }
+            if (record->timestamp_us < *first_us) {
+                *first_us = record->timestamp_us;
+            }
+            if (record->timestamp_us > *last_us) {
+                *last_us = record->timestamp_us;
+            }
+        }
+    }
+    return *first_us <= *last_us;
+}
+
+static int run_buckets(const result_log_t *log, const query_t *query) {
+    int64_t first_us, last_us;
+    if (!matching_time_range(log, query, &first_us, &last_us)) {
+        printf("No %s results in the range.\n", kind_names[query->kind]);
+        return 0;
+    }
+    int64_t origin = floor_div(first_us, query->bucket_us);
+    int64_t num_buckets = floor_div(last_us, query->bucket_us) - origin + 1;
+    if (num_buckets > MAX_BUCKETS) {
+        fprintf(stderr, "Error: %lld buckets; use wider buckets or a shorter range (at most %d).\n",
+                (long long)num_buckets, MAX_BUCKETS);
+        return -1;
+    }
+    resultlog_summary_t *buckets = calloc((size_t)num_buckets, sizeof(resultlog_summary_t));
+    if (!buckets) {
+        fprintf(stderr, "Error: Failed to allocate %lld buckets.\n", (long long)num_buckets);
+        return -1;
+    }
+
+    scan_stats_t scan = {0, 0, 0};
+    for (long long first = 0; first < log->num_slots; first += RESULTLOG_INDEX_EVERY + 1) {
+        const resultlog_index_t *index = block_index(log, first);
+        if (block_skippable(index, query)) {
+            scan.blocks_skipped++;
+            continue;
+        }
+        if (index && !query->use_samples && index->min_timestamp_us >= query->from_us &&
+            index->max_timestamp_us < query->to_us &&
+            floor_div(index->min_timestamp_us, query->bucket_us) == floor_div(index->max_timestamp_us, query->bucket_us)) {
+            merge_summary(&buckets[floor_div(index->min_timestamp_us, query->bucket_us) - origin], &index->kinds[query->kind - 1]);
+            scan.blocks_summarized++;
+            continue;
+        }
+        long long end = block_end(log, first);
+        for (long long slot = first; slot < end; ++slot) {
+            const resultlog_record_t *record = log_slot(log, slot);
+            scan.records_scanned++;
+            if (!record_matches(record, query)) {
+                continue;
+            }
+            resultlog_summary_t *bucket = &buckets[floor_div(record->timestamp_us, query->bucket_us) - origin];
+            if (!query->use_samples) {
+                add_to_summary(bucket, record->value);
+                continue;
+            }
+            for (uint32_t i = 0; i < record->num_samples && i < RESULTLOG_MAX_SAMPLES; ++i) {
+                add_to_summary(bucket, record->samples[i]);
+            }
+        }
+    }
+
+    printf("%s (%s%s), buckets of %lld s, UTC\n", kind_names[query->kind], kind_units[query->kind],
+           query->use_samples ? ", samples" : "", (long long)(query->bucket_us / 1000000));
+    printf("%-19s %10s %10s %10s %10s\n", "Bucket start", "Count", "Mean", "Min", "Max");
+    for (int64_t i = 0; i < num_buckets; ++i) {
+        const resultlog_summary_t *bucket = &buckets[i];
+        if (bucket->count == 0) {
+            continue;
+        }
+        char start_text[32];
+        time_t start_s = (time_t)((origin + i) * query->bucket_us / 1000000);
+        strftime(start_text, sizeof(start_text), "%Y-%m-%d %H:%M:%S", gmtime(&start_s));
+        printf("%-19s %10u %10.2f %10.2f %10.2f\n", start_text, bucket->count, bucket->sum / bucket->count, bucket->min,
+               bucket->max);
+    }
+    printf("Scanned %lld of %lld slots; %lld block(s) skipped and %lld taken from their index.\n", scan.records_scanned,
+           log->num_slots, scan.blocks_skipped, scan.blocks_summarized);
+    free(buckets);
+    return 0;
+}
+// --- End Time Buckets ---
+
+// --- Argument Parsing ---
+// Unix seconds, or "YYYY-MM-DD[ HH:MM[:SS]]" in UTC ('T' may separate date and time)
+static int parse_time(const char *text, int64_t *out_us) {
+    const char *p = text;
+    while (isdigit((unsigned char)*p)) {
+        p++;
+    }
+    if (p != text && *p == '\0') {
+        *out_us = (int64_t)strtoll(text, NULL, 10) * 1000000;
+        return 0;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char separator = 0, rest = 0;
+    int fields = sscanf(text, "%d-%d-%d%c%d:%d:%d%c", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &separator, &tm.tm_hour,
+                        &tm.tm_min, &tm.tm_sec, &rest);
+    if (!(fields == 3 || ((fields == 6 || fields == 7) && (separator == ' ' || separator == 'T'))) ||
+        tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31) {
+        fprintf(stderr, "Error: Invalid time \"%s\", expected Unix seconds or YYYY-MM-DD[ HH:MM[:SS]].\n", text);
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *out_us = (int64_t)timegm(&tm) * 1000000;
+    return 0;
+}
+
+// hour, day, week, or a number with an s, m, h or d suffix
+static int parse_bucket(const char *text, int64_t *out_us) {
+    int64_t seconds = 0;
+    if (strcmp(text, "hour") == 0) {
+        seconds = 3600;
+    } else if (strcmp(text, "day") == 0) {
+        seconds = 86400;
+    } else if (strcmp(text, "week") == 0) {
+        seconds = 7 * 86400;
+    } else {
+        char *end = NULL;
+        long long n = strtoll(text, &end, 10);
+        int64_t unit = 0;
+        if (end != text && end[0] != '\0' && end[1] == '\0') {
+            unit = end[0] == 's' ? 1 : end[0] == 'm' ? 60 : end[0] == 'h' ? 3600 : end[0] == 'd' ? 86400 : 0;
+        }
+        if (n <= 0 || unit == 0) {
+            fprintf(stderr, "Error: Invalid bucket \"%s\", expected hour, day, week or e.g. 15m.\n", text);
+            return -1;
+        }
+        seconds = n * unit;
+    }
+    *out_us = seconds * 1000000;
+    return 0;
+}
+
+static int parse_percentiles(const char *text, query_t *query) {
+    query->num_percentiles = 0;
+    const char *p = text;
+    while (*p) {
+        char *end = NULL;
+        double value = strtod(p, &end);
+        if (end == p || value < 0.0 || value > 100.0 || (*end != ',' && *end != '\0') ||
+            query->num_percentiles == MAX_PERCENTILES) {
+            fprintf(stderr, "Error: Invalid percentiles \"%s\", expected up to %d values from 0 to 100.\n", text,
+                    MAX_PERCENTILES);
+            return -1;
+        }
+        query->percentiles[query->num_percentiles++] = value;
+        p = *end == ',' ? end + 1 : end;
+    }
+    if (query->num_percentiles == 0) {
+        fprintf(stderr, "Error: No percentile given.\n");
+        return -1;
+    }
+    qsort(query->percentiles, query->num_percentiles, sizeof(double), compare_percentiles);
+    return 0;
+}
+
+static void print_usage(const char *prog_name) {
+    printf("Usage: %s [options] <LOG>\n", prog_name);
+    printf("Queries a result log written by speedtest --log.\n");
+    printf("Options:\n");
+    printf("  -t, --test <TEST>      download, upload or latency. (Default: download)\n");
+    printf("  -f, --from <TIME>      Results from this time on: Unix seconds or YYYY-MM-DD[ HH:MM[:SS]], UTC.\n");
+    printf("  -T, --to <TIME>        Results before this time.\n");
+    printf("  -p, --percentiles <LIST> Comma separated percentiles. (Default: %s)\n", DEFAULT_PERCENTILES);
+    printf("  -s, --samples          Use the interval samples of the tests (the probes, for latency) instead\n");
+    printf("                         of one value per test.\n");
+    printf("  -b, --bucket <SPEC>    Count, mean, min and max per bucket: hour, day, week or e.g. 15m, 6h.\n");
+    printf("  -h, --help             Display this help message.\n");
+}
+// --- End Argument Parsing ---
+
+int main(int argc, char *argv[]) {
+    query_t query;
+    memset(&query, 0, sizeof(query));
+    query.kind = RESULTLOG_DOWNLOAD;
+    query.from_us = INT64_MIN;
+    query.to_us = INT64_MAX;
+    parse_percentiles(DEFAULT_PERCENTILES, &query);
+
+    static struct option long_options[] = {
+        {"test", required_argument, 0, 't'},
+        {"from", required_argument, 0, 'f'},
+        {"to", required_argument, 0, 'T'},
+        {"percentiles", required_argument, 0, 'p'},
+        {"samples", no_argument, 0, 's'},
+        {"bucket", required_argument, 0, 'b'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:f:T:p:sb:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                query.kind = 0;
+                for (int kind = RESULTLOG_DOWNLOAD; kind <= RESULTLOG_NUM_KINDS; ++kind) {
+                    if (strcmp(optarg, kind_names[kind]) == 0) {
+                        query.kind = kind;
+                    }
+                }
+                if (query.kind == 0) {
+                    fprintf(stderr, "Error: Unknown test \"%s\", expected download, upload or latency.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                if (parse_time(optarg, &query.from_us) != 0) {
+                    return 1;
+                }
+                break;
+            case 'T':
+                if (parse_time(optarg, &query.to_us) != 0) {
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (parse_percentiles(optarg, &query) != 0) {
+                    return 1;
+                }
+                break;
+            case 's':
+                query.use_samples = 1;
+                break;
+            case 'b':
+                if (parse_bucket(optarg, &query.bucket_us) != 0) {
+                    return 1;
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Error: Expected one log file.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (query.from_us >= query.to_us) {
+        fprintf(stderr, "Error: --from must be before --to.\n");
+        return 1;
+    }
+
+    result_log_t log;
+    if (open_result_log(argv[optind], &log) != 0) {
+        return 1;
+    }
+    int rc = query.bucket_us > 0 ? run_buckets(&log, &query) : run_percentiles(&log, &query);
+    munmap((void *)log.base, log.size);
+    return rc == 0 ? 0 : 1;
+}
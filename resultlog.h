@@ -0,0 +1,87 @@
+// Binary result log of the speed test client (speedtest --log), read by spdtest-query.
+//
+// The log is append-only: a resultlog_header_t, then fixed-size slots of RESULTLOG_RECORD_SIZE
+// bytes. Every slot holds one test result, except that after every RESULTLOG_INDEX_EVERY results
+// an index slot summarizes them (time range, and count, sum, min and max of the value per kind).
+// Slot n is an index slot when n % (RESULTLOG_INDEX_EVERY + 1) == RESULTLOG_INDEX_EVERY, so a
+// reader finds every index without scanning and can skip whole blocks outside a time range.
+// Writers lock the file; a torn slot at its end is overwritten by the next append. Readers skip
+// slots of kinds they do not know.
+//
+// Fields are in the byte order of the host that created the file; byte_order in the header lets
+// a reader reject a file written on a host of the other order.
+#ifndef RESULTLOG_H
+#define RESULTLOG_H
+
+#include <stdint.h>
+
+#define RESULTLOG_MAGIC "SPDTLOG1" // 8 bytes, no terminator in the file
+#define RESULTLOG_VERSION 1
+#define RESULTLOG_BYTE_ORDER 0x01020304u
+#define RESULTLOG_HEADER_SIZE 64
+#define RESULTLOG_RECORD_SIZE 256
+#define RESULTLOG_INDEX_EVERY 1024 // Result slots per index slot
+#define RESULTLOG_MAX_SAMPLES 50 // Longer series are averaged down to fit
+
+// Slot kinds
+#define RESULTLOG_EMPTY 0 // Never written by speedtest
+#define RESULTLOG_DOWNLOAD 1
+#define RESULTLOG_UPLOAD 2
+#define RESULTLOG_LATENCY 3
+#define RESULTLOG_NUM_KINDS 3
+#define RESULTLOG_INDEX 255
+
+// Result flags
+#define RESULTLOG_FLAG_CONVERGED 0x1 // Ended once the rate converged (--converge)
+#define RESULTLOG_FLAG_DURATION_LIMIT 0x2 // Ended at --max-duration
+#define RESULTLOG_FLAG_BUDGET_CUT 0x4 // Cut short by the byte budget
+#define RESULTLOG_FLAG_NO_DATA 0x8 // Nothing was measured (no probe answered); value is not a result
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t index_every;
+    uint32_t max_samples;
+    uint8_t reserved[32];
+} resultlog_header_t;
+
+typedef struct {
+    uint32_t kind; // RESULTLOG_DOWNLOAD, RESULTLOG_UPLOAD or RESULTLOG_LATENCY
+    uint32_t flags;
+    int64_t timestamp_us; // Unix time the test started
+    double value; // Mbps, or the median round trip in ms for latency
+    double duration_s;
+    int64_t bytes;
+    uint32_t connections; // Or the probes sent, for latency
+    uint32_t failed; // Failed transfers, or lost probes
+    float sample_interval_ms; // Between throughput samples (Mbps); 0 for latency, one sample per probe (ms)
+    uint32_t num_samples;
+    float samples[RESULTLOG_MAX_SAMPLES];
+} resultlog_record_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t reserved;
+    double sum;
+    double min;
+    double max;
+} resultlog_summary_t;
+
+typedef struct {
+    uint32_t kind; // RESULTLOG_INDEX
+    uint32_t records; // Result records of the block
+    int64_t min_timestamp_us;
+    int64_t max_timestamp_us;
+    resultlog_summary_t kinds[RESULTLOG_NUM_KINDS]; // Of the value, by kind - 1
+    uint8_t reserved[136];
+} resultlog_index_t;
+
+// The layouts above must keep their sizes
+typedef char resultlog_header_size_check[sizeof(resultlog_header_t) == RESULTLOG_HEADER_SIZE ? 1 : -1];
+typedef char resultlog_record_size_check[sizeof(resultlog_record_t) == RESULTLOG_RECORD_SIZE ? 1 : -1];
+typedef char resultlog_index_size_check[sizeof(resultlog_index_t) == RESULTLOG_RECORD_SIZE ? 1 : -1];
+
+#endif // RESULTLOG_H
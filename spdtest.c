@@ -0,0 +1,1115 @@
+// libspdtest: the libuv/libcurl transfer engine, see spdtest.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spdtest.h"
+#include "spdtest_internal.h"
+#ifdef SPDTEST_HAVE_CARES
+#include <ares.h>
+#endif
+
+#define DNS_DEFAULT_TTL_S 60 // Answers without a TTL (getaddrinfo, hosts file), as libcurl's DNS cache
+#define DNS_MAX_TTL_S 3600
+#define DNS_MAX_ADDRESSES_LEN 512
+
+// A transfer added to the engine. Pending transfers are out of the multi handle but still count
+// as running until they are resumed or dropped.
+typedef struct {
+    CURL *easy_handle;
+    int pending;
+} engine_transfer_t;
+
+// State of a socket polled for libcurl. The poll handle comes first, so the context can be passed
+// wherever a uv_poll_t is expected.
+typedef struct {
+    uv_poll_t poll_handle;
+    spdtest_socket_t socket;
+    spdtest_engine_t *engine;
+} engine_socket_t;
+
+// A caller waiting for a lookup
+typedef struct dns_waiter_s {
+    spdtest_resolve_cb cb;
+    void *user_data;
+    struct dns_waiter_s *next;
+} dns_waiter_t;
+
+typedef struct dns_entry_s dns_entry_t;
+
+#ifdef SPDTEST_HAVE_CARES
+// A socket polled for c-ares, laid out like engine_socket_t
+typedef struct dns_socket_s {
+    uv_poll_t poll_handle;
+    ares_socket_t fd;
+    spdtest_engine_t *engine;
+    struct dns_socket_s *next;
+} dns_socket_t;
+#else
+typedef struct {
+    uv_getaddrinfo_t req;
+    spdtest_engine_t *engine;
+    dns_entry_t *entry; // NULL once the lookup was cancelled
+} dns_request_t;
+#endif
+
+// The cached answer for one host and port
+struct dns_entry_s {
+    struct dns_entry_s *next;
+    spdtest_engine_t *engine;
+    char *host; // IPv6 addresses are never looked up
+    int port;
+    char *addresses; // Of the last answer, NULL until one arrived
+    struct curl_slist *resolve; // CURLOPT_RESOLVE list pinned on easy handles
+    uint64_t expires_ns;
+    uint64_t lookup_start_ns;
+    double lookup_ms;
+    int resolving;
+    dns_waiter_t *waiters;
+#ifndef SPDTEST_HAVE_CARES
+    dns_request_t *request;
+#endif
+};
+
+struct spdtest_engine_s {
+    uv_loop_t *loop;
+    int owns_loop;
+    CURLM *multi;
+    spdtest_callbacks_t callbacks;
+    uv_timer_t timeout_timer; // libcurl's timeout
+    // libcurl's zero-ms timeouts run on the next loop turn from an idle handle, coalesced into one
+    // curl_multi_socket_action however often libcurl asks before then
+    uv_idle_t kick_idle;
+    int kick_scheduled;
+    int timeout_mode; // SPDTEST_TIMEOUT_DEFER unless changed for spdtest-stress
+    spdtest_engine_counters_t counters;
+    // Completed transfers are harvested once per loop iteration, after all socket and timer
+    // callbacks of the iteration ran, instead of after every curl_multi_socket_action call
+    uv_check_t completion_check;
+    int completions_pending; // libcurl did work since the last harvest
+    uv_timer_t progress_timer;
+    engine_transfer_t *transfers; // Running transfers, in no particular order
+    int num_transfers;
+    int transfers_capacity;
+    int in_run; // Inside spdtest_engine_run, which is ended with uv_stop
+    int open_handles; // Closed by spdtest_engine_destroy before the engine is freed, and lookups
+    uint64_t start_ns;
+    long long bytes;
+    uint64_t last_progress_ns;
+    long long last_progress_bytes;
+    // DNS cache and lookups (see DNS Resolution)
+    dns_entry_t *dns_cache;
+    int dns_lookups; // In flight
+    uv_timer_t dns_timer; // c-ares' timeouts
+#ifdef SPDTEST_HAVE_CARES
+    ares_channel dns_channel; // Created by the first lookup
+    int dns_channel_ready;
+    dns_socket_t *dns_sockets;
+#endif
+};
+
+static void harvest_completions(spdtest_engine_t *engine);
+static void release_engine(spdtest_engine_t *engine);
+#ifdef SPDTEST_HAVE_CARES
+static void on_dns_timer(uv_timer_t *timer);
+#endif
+
+// --- Transfer Tracking ---
+static int find_transfer(const spdtest_engine_t *engine, CURL *easy_handle) {
+    // Searched from the end: the most recently added transfers tend to be looked up
+    for (int i = engine->num_transfers - 1; i >= 0; --i) {
+        if (engine->transfers[i].easy_handle == easy_handle) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A completion callback may free its handle and add a new transfer that gets the same address;
+// the completed transfer is the one still pending
+static int find_pending_transfer(const spdtest_engine_t *engine, CURL *easy_handle) {
+    for (int i = engine->num_transfers - 1; i >= 0; --i) {
+        if (engine->transfers[i].easy_handle == easy_handle && engine->transfers[i].pending) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int track_transfer(spdtest_engine_t *engine, CURL *easy_handle) {
+    if (engine->num_transfers == engine->transfers_capacity) {
+        int capacity = engine->transfers_capacity ? engine->transfers_capacity * 2 : 64;
+        engine_transfer_t *transfers = realloc(engine->transfers, capacity * sizeof(engine_transfer_t));
+        if (!transfers) {
+            return -1;
+        }
+        engine->transfers = transfers;
+        engine->transfers_capacity = capacity;
+    }
+    engine->transfers[engine->num_transfers].easy_handle = easy_handle;
+    engine->transfers[engine->num_transfers].pending = 0;
+    engine->num_transfers++;
+    return 0;
+}
+
+static void untrack_transfer(spdtest_engine_t *engine, int index) {
+    engine->transfers[index] = engine->transfers[--engine->num_transfers];
+}
+
+// Called whenever the number of running transfers may have dropped to zero
+static void check_idle(spdtest_engine_t *engine) {
+    if (engine->num_transfers > 0) {
+        return;
+    }
+    uv_timer_stop(&engine->timeout_timer);
+    if (engine->callbacks.on_idle) {
+        engine->callbacks.on_idle(engine, engine->callbacks.user_data);
+    }
+    // Other handles on the loop may keep it alive, so the run is ended explicitly
+    if (engine->in_run && engine->num_transfers == 0) {
+        uv_stop(engine->loop);
+    }
+}
+// --- End Transfer Tracking ---
+
+// --- libuv/libcurl Bridge ---
+static void free_socket_context(uv_handle_t *handle) {
+    free(handle);
+}
+
+static void on_curl_timeout(uv_timer_t *timer) {
+    spdtest_engine_t *engine = timer->data;
+    int still_running = 0;
+    engine->counters.socket_actions++;
+    CURLMcode mc = curl_multi_socket_action(engine->multi, CURL_SOCKET_TIMEOUT, 0, &still_running);
+    if (mc == CURLM_RECURSIVE_API_CALL) {
+        engine->counters.recursive_calls++;
+    }
+    // Refused nested calls are what SPDTEST_TIMEOUT_SYNC demonstrates, they are only counted there
+    if (mc != CURLM_OK && !(mc == CURLM_RECURSIVE_API_CALL && engine->timeout_mode == SPDTEST_TIMEOUT_SYNC)) {
+        fprintf(stderr, "curl_multi_socket_action (timeout) failed: %s\n", curl_multi_strerror(mc));
+    }
+    // The running count is kept by the engine; libcurl's excludes transfers whose completion
+    // message has not been read yet.
+    engine->completions_pending = 1;
+}
+
+// A pending idle handle makes the loop poll without blocking, so this runs right after the
+// current iteration instead of a timer tick later
+static void on_curl_kick(uv_idle_t *handle) {
+    spdtest_engine_t *engine = handle->data;
+    uv_idle_stop(handle);
+    engine->kick_scheduled = 0;
+    engine->counters.kicks++;
+    on_curl_timeout(&engine->timeout_timer);
+}
+
+// Called by libcurl when it wants to set or clear its timeout
+static int handle_curl_timeout(CURLM *multi, long timeout_ms, void *userp) {
+    spdtest_engine_t *engine = userp;
+    // Every call replaces the previous timeout, whichever way it was scheduled
+    uv_timer_stop(&engine->timeout_timer);
+    if (timeout_ms != 0 && engine->kick_scheduled) {
+        uv_idle_stop(&engine->kick_idle);
+        engine->kick_scheduled = 0;
+    }
+    if (timeout_ms == 0) {
+        engine->counters.zero_timeouts++;
+        // "Act immediately", but libcurl does not allow curl_multi_socket_action from inside its
+        // own callbacks: run it on the next loop turn, once however often it is asked for.
+        switch (engine->timeout_mode) {
+            case SPDTEST_TIMEOUT_TIMER:
+                uv_timer_start(&engine->timeout_timer, on_curl_timeout, 1, 0);
+                break;
+            case SPDTEST_TIMEOUT_SYNC:
+                on_curl_timeout(&engine->timeout_timer);
+                break;
+            default:
+                if (!engine->kick_scheduled) {
+                    uv_idle_start(&engine->kick_idle, on_curl_kick);
+                    engine->kick_scheduled = 1;
+                }
+                break;
+        }
+    } else if (timeout_ms > 0) {
+        uv_timer_start(&engine->timeout_timer, on_curl_timeout, timeout_ms, 0);
+    }
+    return 0;
+}
+
+static void on_socket_event(uv_poll_t *handle, int status, int events) {
+    engine_socket_t *socket_ctx = (engine_socket_t *)handle;
+    spdtest_engine_t *engine = socket_ctx->engine;
+    if (status < 0) {
+        fprintf(stderr, "on_socket_event error: %s\n", uv_strerror(status));
+    }
+    int flags = 0;
+    if (status < 0) flags = CURL_CSELECT_ERR; // Let libcurl notice the failed socket
+    if (events & UV_READABLE) flags |= CURL_CSELECT_IN;
+    if (events & UV_WRITABLE) flags |= CURL_CSELECT_OUT;
+
+    int still_running = 0;
+    engine->counters.socket_actions++;
+    CURLMcode mc = curl_multi_socket_action(engine->multi, socket_ctx->socket.sockfd, flags, &still_running);
+    if (mc != CURLM_OK) {
+        fprintf(stderr, "curl_multi_socket_action (socket event) failed: %s\n", curl_multi_strerror(mc));
+    }
+    engine->completions_pending = 1;
+}
+
+static void close_socket_context(spdtest_engine_t *engine, engine_socket_t *socket_ctx) {
+    uv_poll_stop(&socket_ctx->poll_handle);
+    if (engine->callbacks.on_socket_close) {
+        engine->callbacks.on_socket_close(engine, &socket_ctx->socket, engine->callbacks.user_data);
+    }
+    uv_close((uv_handle_t *)&socket_ctx->poll_handle, free_socket_context);
+    curl_multi_assign(engine->multi, socket_ctx->socket.sockfd, NULL); // Clear the socket pointer in libcurl
+}
+
+// Allocates the context of a socket and starts its poll handle, not polling yet
+static engine_socket_t *new_socket_context(spdtest_engine_t *engine, curl_socket_t sockfd) {
+    engine_socket_t *socket_ctx = malloc(sizeof(engine_socket_t));
+    if (!socket_ctx) {
+        fprintf(stderr, "Error: Failed to allocate a socket context.\n");
+        return NULL;
+    }
+    int init_err = uv_poll_init_socket(engine->loop, &socket_ctx->poll_handle, sockfd);
+    if (init_err != 0) {
+        fprintf(stderr, "Error: uv_poll_init_socket failed: %s\n", uv_strerror(init_err));
+        free(socket_ctx);
+        return NULL;
+    }
+    socket_ctx->socket.sockfd = sockfd;
+    socket_ctx->socket.data = NULL;
+    socket_ctx->engine = engine;
+    return socket_ctx;
+}
+
+// Called by libcurl when it needs to perform an action on a socket
+static int handle_curl_socket(CURL *easy, curl_socket_t sockfd, int action, void *userp, void *socketp) {
+    spdtest_engine_t *engine = userp;
+    engine_socket_t *socket_ctx = socketp;
+
+    if (action == CURL_POLL_REMOVE) {
+        if (socket_ctx) {
+            close_socket_context(engine, socket_ctx);
+        }
+        return 0;
+    }
+    int is_new = !socket_ctx;
+    if (is_new) {
+        socket_ctx = new_socket_context(engine, sockfd);
+        if (!socket_ctx) {
+            return -1;
+        }
+        CURLMcode mc = curl_multi_assign(engine->multi, sockfd, socket_ctx);
+        if (mc != CURLM_OK) {
+            fprintf(stderr, "curl_multi_assign failed: %s\n", curl_multi_strerror(mc));
+            uv_close((uv_handle_t *)&socket_ctx->poll_handle, free_socket_context);
+            return -1;
+        }
+        if (engine->callbacks.on_socket_open) {
+            engine->callbacks.on_socket_open(engine, &socket_ctx->socket, engine->callbacks.user_data);
+        }
+    }
+    if (engine->callbacks.on_socket_update) {
+        engine->callbacks.on_socket_update(engine, &socket_ctx->socket, engine->callbacks.user_data);
+    }
+
+    int events = 0;
+    if (action == CURL_POLL_IN || action == CURL_POLL_INOUT) {
+        events |= UV_READABLE;
+    }
+    if (action == CURL_POLL_OUT || action == CURL_POLL_INOUT) {
+        events |= UV_WRITABLE;
+    }
+    if (events == 0) {
+        // libcurl keeps the socket but waits for nothing on it for now
+        uv_poll_stop(&socket_ctx->poll_handle);
+        return 0;
+    }
+    int start_err = uv_poll_start(&socket_ctx->poll_handle, events, on_socket_event);
+    if (start_err != 0) {
+        fprintf(stderr, "uv_poll_start failed: %s\n", uv_strerror(start_err));
+        // A socket that was polled before keeps its context, libcurl may ask again
+        if (is_new) {
+            close_socket_context(engine, socket_ctx);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Runs once per loop iteration after polling for I/O. One curl_multi_info_read sweep covers every
+// socket that was ready in the iteration; retries and follow-up transfers start from here too.
+static void on_completion_check(uv_check_t *handle) {
+    spdtest_engine_t *engine = handle->data;
+    if (engine->completions_pending) {
+        engine->completions_pending = 0;
+        harvest_completions(engine);
+    }
+}
+
+static void harvest_completions(spdtest_engine_t *engine) {
+    CURLMsg *msg;
+    int msgs_left;
+    engine->counters.harvests++;
+    while ((msg = curl_multi_info_read(engine->multi, &msgs_left))) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+        CURL *easy_handle = msg->easy_handle;
+        CURLcode result = msg->data.result;
+        curl_multi_remove_handle(engine->multi, easy_handle); // msg is invalid from here on
+
+        int index = find_transfer(engine, easy_handle);
+        if (index < 0) {
+            continue; // Added to the multi handle behind the engine's back
+        }
+        engine->transfers[index].pending = 1; // The callback may resume it right away
+        int status = SPDTEST_TRANSFER_DONE;
+        if (engine->callbacks.on_transfer_done) {
+            status = engine->callbacks.on_transfer_done(engine, easy_handle, result, engine->callbacks.user_data);
+        }
+        if (status == SPDTEST_TRANSFER_PENDING) {
+            continue;
+        }
+        // The callback may have added transfers, which moves entries around
+        index = find_pending_transfer(engine, easy_handle);
+        if (index >= 0) {
+            untrack_transfer(engine, index);
+        }
+    }
+    check_idle(engine);
+}
+// --- End libuv/libcurl Bridge ---
+
+// --- Progress ---
+static void on_progress_timer(uv_timer_t *timer) {
+    spdtest_engine_t *engine = timer->data;
+    uint64_t now_ns = uv_hrtime();
+    spdtest_progress_t progress;
+    progress.running_transfers = engine->num_transfers;
+    progress.bytes = engine->bytes;
+    progress.elapsed_s = (now_ns - engine->start_ns) / 1e9;
+    double interval_s = (now_ns - engine->last_progress_ns) / 1e9;
+    progress.interval_mbps = interval_s > 0.0 ? (engine->bytes - engine->last_progress_bytes) * 8.0 / interval_s / 1e6 : 0.0;
+    engine->last_progress_ns = now_ns;
+    engine->last_progress_bytes = engine->bytes;
+    engine->callbacks.on_progress(engine, &progress, engine->callbacks.user_data);
+}
+// --- End Progress ---
+
+// --- DNS Resolution ---
+// Hostnames are resolved on the engine's loop before the transfers that need them: with c-ares,
+// whose sockets are polled and whose timeouts run like libcurl's, or with uv_getaddrinfo on
+// libuv's threadpool. Answers are cached per host and port for their TTL and pinned on easy
+// handles as "+host:port:addresses" CURLOPT_RESOLVE entries, so libcurl neither blocks nor spawns
+// a resolver thread, and the '+' lets them expire from libcurl's own cache as usual.
+
+// Resolves the host and port of url. Returns 0, or UV_EINVAL when url has no host.
+static int parse_url_host(const char *url, char **host_out, int *port_out) {
+    CURLU *parsed = curl_url();
+    char *host = NULL;
+    char *port = NULL;
+    int rc = UV_EINVAL;
+    if (parsed && curl_url_set(parsed, CURLUPART_URL, url, CURLU_GUESS_SCHEME) == CURLUE_OK &&
+        curl_url_get(parsed, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+        curl_url_get(parsed, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK) {
+        // IPv6 addresses come in brackets
+        size_t len = strlen(host);
+        if (len > 2 && host[0] == '[' && host[len - 1] == ']') {
+            *host_out = malloc(len - 1);
+            if (*host_out) {
+                memcpy(*host_out, host + 1, len - 2);
+                (*host_out)[len - 2] = '\0';
+            }
+        } else {
+            *host_out = strdup(host);
+        }
+        *port_out = atoi(port);
+        rc = *host_out ? 0 : UV_ENOMEM;
+    }
+    curl_free(host);
+    curl_free(port);
+    curl_url_cleanup(parsed);
+    return rc;
+}
+
+static int is_ip_address(const char *host) {
+    unsigned char addr[16];
+    return uv_inet_pton(AF_INET, host, addr) == 0 || uv_inet_pton(AF_INET6, host, addr) == 0;
+}
+
+static dns_entry_t *find_dns_entry(const spdtest_engine_t *engine, const char *host, int port) {
+    for (dns_entry_t *entry = engine->dns_cache; entry; entry = entry->next) {
+        if (entry->port == port && strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Appends an address to a comma separated list unless it is already on it
+static void append_address(char *list, size_t size, const struct sockaddr *addr) {
+    char name[INET6_ADDRSTRLEN + 2];
+    if (addr->sa_family == AF_INET6) {
+        name[0] = '[';
+        uv_ip6_name((const struct sockaddr_in6 *)addr, name + 1, INET6_ADDRSTRLEN);
+        strcat(name, "]");
+    } else if (addr->sa_family == AF_INET) {
+        uv_ip4_name((const struct sockaddr_in *)addr, name, sizeof(name));
+    } else {
+        return;
+    }
+    size_t name_len = strlen(name);
+    for (const char *at = strstr(list, name); at; at = strstr(at + 1, name)) {
+        if ((at == list || at[-1] == ',') && (at[name_len] == ',' || at[name_len] == '\0')) {
+            return;
+        }
+    }
+    size_t len = strlen(list);
+    if (len + name_len + 2 > size) {
+        return; // Long answers keep their first addresses
+    }
+    snprintf(list + len, size - len, "%s%s", len > 0 ? "," : "", name);
+}
+
+// Stores an answer in the entry. Handles already pinned keep pointing at the entry's
+// CURLOPT_RESOLVE list, so its string is swapped in place.
+static int cache_answer(dns_entry_t *entry, const char *addresses, int ttl_s, uint64_t now_ns) {
+    if (ttl_s <= 0) {
+        ttl_s = DNS_DEFAULT_TTL_S;
+    } else if (ttl_s > DNS_MAX_TTL_S) {
+        ttl_s = DNS_MAX_TTL_S;
+    }
+    size_t pair_size = strlen(entry->host) + strlen(addresses) + 16;
+    char *pair = malloc(pair_size);
+    char *copy = strdup(addresses);
+    struct curl_slist *fresh = NULL;
+    if (pair) {
+        snprintf(pair, pair_size, "+%s:%d:%s", entry->host, entry->port, addresses);
+        fresh = curl_slist_append(NULL, pair);
+        free(pair);
+    }
+    if (!fresh || !copy) {
+        curl_slist_free_all(fresh);
+        free(copy);
+        return UV_ENOMEM;
+    }
+    if (entry->resolve) {
+        char *old = entry->resolve->data;
+        entry->resolve->data = fresh->data;
+        fresh->data = old;
+        curl_slist_free_all(fresh);
+    } else {
+        entry->resolve = fresh;
+    }
+    free(entry->addresses);
+    entry->addresses = copy;
+    entry->expires_ns = now_ns + (uint64_t)ttl_s * 1000000000ULL;
+    return 0;
+}
+
+// Ends the lookup of an entry: caches a successful answer and reports it to every waiter
+static void finish_lookup(dns_entry_t *entry, int status, const char *addresses, int ttl_s) {
+    spdtest_engine_t *engine = entry->engine;
+    uint64_t now_ns = uv_hrtime();
+    entry->resolving = 0;
+    entry->lookup_ms = (now_ns - entry->lookup_start_ns) / 1e6;
+    if (status == 0 && addresses[0] == '\0') {
+        status = UV_EAI_NODATA;
+    }
+    if (status == 0) {
+        status = cache_answer(entry, addresses, ttl_s, now_ns);
+    }
+
+    spdtest_dns_result_t result;
+    result.host = entry->host;
+    result.port = entry->port;
+    result.status = status;
+    result.addresses = status == 0 ? entry->addresses : NULL;
+    result.lookup_ms = entry->lookup_ms;
+    result.cached = 0;
+    // Waiters may resolve again, so the list is taken first
+    dns_waiter_t *waiter = entry->waiters;
+    entry->waiters = NULL;
+    while (waiter) {
+        dns_waiter_t *next = waiter->next;
+        waiter->cb(engine, &result, waiter->user_data);
+        free(waiter);
+        waiter = next;
+    }
+}
+
+#ifdef SPDTEST_HAVE_CARES
+static int ares_status_to_uv(int status) {
+    switch (status) {
+        case ARES_SUCCESS: return 0;
+        case ARES_ENOTFOUND: return UV_EAI_NONAME;
+        case ARES_ENODATA: return UV_EAI_NODATA;
+        case ARES_ETIMEOUT: return UV_ETIMEDOUT;
+        case ARES_ENOMEM: return UV_ENOMEM;
+        case ARES_ECANCELLED:
+        case ARES_EDESTRUCTION: return UV_ECANCELED;
+        case ARES_EBADSTR:
+        case ARES_EBADNAME: return UV_EINVAL;
+        default: return UV_EAI_FAIL;
+    }
+}
+
+// Keeps c-ares' next timeout on the engine's DNS timer while lookups are in flight
+static void schedule_dns_timer(spdtest_engine_t *engine) {
+    struct timeval max_wait, wait;
+    uv_timer_stop(&engine->dns_timer);
+    if (engine->dns_lookups == 0) {
+        return;
+    }
+    max_wait.tv_sec = 1;
+    max_wait.tv_usec = 0;
+    struct timeval *next = ares_timeout(engine->dns_channel, &max_wait, &wait);
+    uv_timer_start(&engine->dns_timer, on_dns_timer, (uint64_t)next->tv_sec * 1000 + next->tv_usec / 1000, 0);
+}
+
+static void on_dns_timer(uv_timer_t *timer) {
+    spdtest_engine_t *engine = timer->data;
+    ares_process_fd(engine->dns_channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+    schedule_dns_timer(engine);
+}
+
+static void on_dns_socket_event(uv_poll_t *handle, int status, int events) {
+    dns_socket_t *dns_socket = (dns_socket_t *)handle;
+    spdtest_engine_t *engine = dns_socket->engine;
+    // An error is passed on as readable, c-ares notices it when it reads
+    ares_socket_t read_fd = (status < 0 || (events & UV_READABLE)) ? dns_socket->fd : ARES_SOCKET_BAD;
+    ares_socket_t write_fd = (status == 0 && (events & UV_WRITABLE)) ? dns_socket->fd : ARES_SOCKET_BAD;
+    ares_process_fd(engine->dns_channel, read_fd, write_fd);
+    schedule_dns_timer(engine);
+}
+
+static void close_dns_socket(spdtest_engine_t *engine, dns_socket_t *dns_socket) {
+    for (dns_socket_t **link = &engine->dns_sockets; *link; link = &(*link)->next) {
+        if (*link == dns_socket) {
+            *link = dns_socket->next;
+            break;
+        }
+    }
+    uv_poll_stop(&dns_socket->poll_handle);
+    uv_close((uv_handle_t *)&dns_socket->poll_handle, free_socket_context);
+}
+
+// Called by c-ares when it opens, closes or changes interest in a socket
+static void on_dns_socket_state(void *data, ares_socket_t fd, int readable, int writable) {
+    spdtest_engine_t *engine = data;
+    dns_socket_t *dns_socket = engine->dns_sockets;
+    while (dns_socket && dns_socket->fd != fd) {
+        dns_socket = dns_socket->next;
+    }
+    if (!readable && !writable) {
+        if (dns_socket) {
+            close_dns_socket(engine, dns_socket);
+        }
+        return;
+    }
+    if (!dns_socket) {
+        dns_socket = malloc(sizeof(dns_socket_t));
+        if (!dns_socket) {
+            fprintf(stderr, "Error: Failed to allocate a DNS socket context.\n");
+            return; // The lookup times out
+        }
+        int init_err = uv_poll_init_socket(engine->loop, &dns_socket->poll_handle, fd);
+        if (init_err != 0) {
+            fprintf(stderr, "Error: uv_poll_init_socket (DNS) failed: %s\n", uv_strerror(init_err));
+            free(dns_socket);
+            return;
+        }
+        dns_socket->fd = fd;
+        dns_socket->engine = engine;
+        dns_socket->next = engine->dns_sockets;
+        engine->dns_sockets = dns_socket;
+    }
+    int events = (readable ? UV_READABLE : 0) | (writable ? UV_WRITABLE : 0);
+    int start_err = uv_poll_start(&dns_socket->poll_handle, events, on_dns_socket_event);
+    if (start_err != 0) {
+        fprintf(stderr, "uv_poll_start (DNS) failed: %s\n", uv_strerror(start_err));
+    }
+}
+
+static void on_ares_addrinfo(void *arg, int status, int timeouts, struct ares_addrinfo *answer) {
+    dns_entry_t *entry = arg;
+    (void)timeouts;
+    char addresses[DNS_MAX_ADDRESSES_LEN] = "";
+    int ttl_s = 0;
+    if (status == ARES_SUCCESS && answer) {
+        for (struct ares_addrinfo_node *node = answer->nodes; node; node = node->ai_next) {
+            append_address(addresses, sizeof(addresses), node->ai_addr);
+            if (node->ai_ttl > 0 && (ttl_s == 0 || node->ai_ttl < ttl_s)) {
+                ttl_s = node->ai_ttl;
+            }
+        }
+    }
+    ares_freeaddrinfo(answer);
+    entry->engine->dns_lookups--;
+    finish_lookup(entry, ares_status_to_uv(status), addresses, ttl_s);
+}
+
+// ares_library_init and ares_library_cleanup are not thread-safe, and engines may be created on
+// several threads: the library is initialized once per process and left for the process exit
+static uv_once_t ares_library_once = UV_ONCE_INIT;
+static int ares_library_status;
+
+static void init_ares_library(void) {
+    ares_library_status = ares_library_init(ARES_LIB_INIT_ALL);
+}
+
+static int create_dns_channel(spdtest_engine_t *engine) {
+    struct ares_options options;
+    memset(&options, 0, sizeof(options));
+    options.sock_state_cb = on_dns_socket_state;
+    options.sock_state_cb_data = engine;
+    uv_once(&ares_library_once, init_ares_library);
+    if (ares_library_status != ARES_SUCCESS) {
+        return ares_status_to_uv(ares_library_status);
+    }
+    int status = ares_init_options(&engine->dns_channel, &options, ARES_OPT_SOCK_STATE_CB);
+    if (status != ARES_SUCCESS) {
+        return ares_status_to_uv(status);
+    }
+    engine->dns_channel_ready = 1;
+    return 0;
+}
+
+static int start_lookup(dns_entry_t *entry) {
+    spdtest_engine_t *engine = entry->engine;
+    if (!engine->dns_channel_ready) {
+        int rc = create_dns_channel(engine);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    char port[8];
+    snprintf(port, sizeof(port), "%d", entry->port);
+    struct ares_addrinfo_hints hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = ARES_AI_NOSORT; // libcurl races the address families itself
+    engine->dns_lookups++;
+    // May answer before returning, from the hosts file
+    ares_getaddrinfo(engine->dns_channel, entry->host, port, &hints, on_ares_addrinfo, entry);
+    schedule_dns_timer(engine);
+    return 0;
+}
+
+static void cancel_lookups(spdtest_engine_t *engine) {
+    if (!engine->dns_channel_ready) {
+        return;
+    }
+    ares_destroy(engine->dns_channel); // Ends the lookups in flight with ARES_EDESTRUCTION
+    engine->dns_channel_ready = 0;
+    while (engine->dns_sockets) {
+        close_dns_socket(engine, engine->dns_sockets);
+    }
+}
+#else
+static void on_uv_addrinfo(uv_getaddrinfo_t *req, int status, struct addrinfo *answer) {
+    dns_request_t *request = (dns_request_t *)req;
+    spdtest_engine_t *engine = request->engine;
+    dns_entry_t *entry = request->entry;
+    char addresses[DNS_MAX_ADDRESSES_LEN] = "";
+    for (struct addrinfo *node = answer; status == 0 && node; node = node->ai_next) {
+        append_address(addresses, sizeof(addresses), node->ai_addr);
+    }
+    uv_freeaddrinfo(answer);
+    free(request);
+    if (entry) {
+        entry->request = NULL;
+        engine->dns_lookups--;
+        finish_lookup(entry, status, addresses, 0); // getaddrinfo has no TTL
+    }
+    release_engine(engine);
+}
+
+static int start_lookup(dns_entry_t *entry) {
+    spdtest_engine_t *engine = entry->engine;
+    dns_request_t *request = malloc(sizeof(dns_request_t));
+    if (!request) {
+        return UV_ENOMEM;
+    }
+    request->engine = engine;
+    request->entry = entry;
+    char port[8];
+    snprintf(port, sizeof(port), "%d", entry->port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = uv_getaddrinfo(engine->loop, &request->req, on_uv_addrinfo, entry->host, port, &hints);
+    if (rc != 0) {
+        free(request);
+        return rc;
+    }
+    entry->request = request;
+    engine->dns_lookups++;
+    engine->open_handles++; // The engine outlives the request, see release_engine
+    return 0;
+}
+
+static void cancel_lookups(spdtest_engine_t *engine) {
+    for (dns_entry_t *entry = engine->dns_cache; entry; entry = entry->next) {
+        dns_request_t *request = entry->request;
+        if (!request) {
+            continue;
+        }
+        // The request completes later on its own and only releases the engine
+        request->entry = NULL;
+        entry->request = NULL;
+        uv_cancel((uv_req_t *)&request->req);
+        engine->dns_lookups--;
+        finish_lookup(entry, UV_ECANCELED, "", 0);
+    }
+}
+#endif
+
+static void free_dns_cache(spdtest_engine_t *engine) {
+    while (engine->dns_cache) {
+        dns_entry_t *entry = engine->dns_cache;
+        engine->dns_cache = entry->next;
+        free(entry->host);
+        free(entry->addresses);
+        curl_slist_free_all(entry->resolve);
+        free(entry);
+    }
+}
+// --- End DNS Resolution ---
+
+// --- Public API ---
+spdtest_engine_t *spdtest_engine_create(uv_loop_t *loop, const spdtest_callbacks_t *callbacks) {
+    spdtest_engine_t *engine = calloc(1, sizeof(spdtest_engine_t));
+    if (!engine) {
+        return NULL;
+    }
+    if (callbacks) {
+        engine->callbacks = *callbacks;
+    }
+    if (!loop) {
+        loop = malloc(sizeof(uv_loop_t));
+        if (!loop || uv_loop_init(loop) != 0) {
+            free(loop);
+            free(engine);
+            return NULL;
+        }
+        engine->owns_loop = 1;
+    }
+    engine->loop = loop;
+    engine->multi = curl_multi_init();
+    if (!engine->multi) {
+        if (engine->owns_loop) {
+            uv_loop_close(loop);
+            free(loop);
+        }
+        free(engine);
+        return NULL;
+    }
+    uv_timer_init(loop, &engine->timeout_timer);
+    engine->timeout_timer.data = engine;
+    uv_idle_init(loop, &engine->kick_idle);
+    engine->kick_idle.data = engine;
+    // Unreferenced: it runs while anything else keeps the loop alive, but does not do so itself
+    uv_check_init(loop, &engine->completion_check);
+    engine->completion_check.data = engine;
+    uv_check_start(&engine->completion_check, on_completion_check);
+    uv_unref((uv_handle_t *)&engine->completion_check);
+    // Progress reports do not keep the loop alive either
+    uv_timer_init(loop, &engine->progress_timer);
+    engine->progress_timer.data = engine;
+    uv_unref((uv_handle_t *)&engine->progress_timer);
+    uv_timer_init(loop, &engine->dns_timer);
+    engine->dns_timer.data = engine;
+    engine->open_handles = 5;
+
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETFUNCTION, handle_curl_socket);
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETDATA, engine);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERFUNCTION, handle_curl_timeout);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERDATA, engine);
+    return engine;
+}
+
+static void release_engine(spdtest_engine_t *engine) {
+    if (--engine->open_handles == 0) {
+        free(engine->transfers);
+        free(engine);
+    }
+}
+
+static void on_engine_handle_closed(uv_handle_t *handle) {
+    release_engine(handle->data);
+}
+
+void spdtest_engine_destroy(spdtest_engine_t *engine) {
+    if (!engine) {
+        return;
+    }
+    spdtest_engine_stop(engine);
+    curl_multi_cleanup(engine->multi); // Closes the remaining sockets through handle_curl_socket
+    cancel_lookups(engine);
+    free_dns_cache(engine);
+    uv_loop_t *loop = engine->loop;
+    int owns_loop = engine->owns_loop;
+    uv_close((uv_handle_t *)&engine->timeout_timer, on_engine_handle_closed);
+    uv_close((uv_handle_t *)&engine->kick_idle, on_engine_handle_closed);
+    uv_close((uv_handle_t *)&engine->completion_check, on_engine_handle_closed);
+    uv_close((uv_handle_t *)&engine->progress_timer, on_engine_handle_closed);
+    uv_close((uv_handle_t *)&engine->dns_timer, on_engine_handle_closed);
+    if (owns_loop) {
+        uv_run(loop, UV_RUN_DEFAULT); // Only close callbacks are left
+        uv_loop_close(loop);
+        free(loop);
+    }
+}
+
+uv_loop_t *spdtest_engine_loop(const spdtest_engine_t *engine) {
+    return engine->loop;
+}
+
+CURLM *spdtest_engine_multi(const spdtest_engine_t *engine) {
+    return engine->multi;
+}
+
+int spdtest_engine_running(const spdtest_engine_t *engine) {
+    return engine->num_transfers;
+}
+
+CURLMcode spdtest_engine_add(spdtest_engine_t *engine, CURL *easy_handle) {
+    // Tracked first: adding a handle can already complete it through the socket callback
+    if (track_transfer(engine, easy_handle) != 0) {
+        return CURLM_OUT_OF_MEMORY;
+    }
+    CURLMcode mc = curl_multi_add_handle(engine->multi, easy_handle);
+    if (mc != CURLM_OK) {
+        untrack_transfer(engine, find_transfer(engine, easy_handle));
+    }
+    return mc;
+}
+
+CURLMcode spdtest_engine_resume(spdtest_engine_t *engine, CURL *easy_handle) {
+    int index = find_pending_transfer(engine, easy_handle);
+    if (index < 0) {
+        return CURLM_BAD_EASY_HANDLE;
+    }
+    engine->transfers[index].pending = 0;
+    CURLMcode mc = curl_multi_add_handle(engine->multi, easy_handle);
+    if (mc != CURLM_OK) {
+        engine->transfers[index].pending = 1;
+        spdtest_engine_drop(engine, easy_handle);
+    }
+    return mc;
+}
+
+void spdtest_engine_drop(spdtest_engine_t *engine, CURL *easy_handle) {
+    int index = find_pending_transfer(engine, easy_handle);
+    if (index >= 0) {
+        untrack_transfer(engine, index);
+        check_idle(engine);
+    }
+}
+
+void spdtest_engine_remove(spdtest_engine_t *engine, CURL *easy_handle) {
+    int index = find_transfer(engine, easy_handle);
+    if (index < 0) {
+        return;
+    }
+    if (!engine->transfers[index].pending) {
+        curl_multi_remove_handle(engine->multi, easy_handle);
+    }
+    untrack_transfer(engine, index);
+    check_idle(engine);
+}
+
+void spdtest_engine_count_bytes(spdtest_engine_t *engine, long long bytes) {
+    engine->bytes += bytes;
+}
+
+int spdtest_engine_resolve(spdtest_engine_t *engine, const char *url, spdtest_resolve_cb cb, void *user_data) {
+    char *host = NULL;
+    int port = 0;
+    int rc = parse_url_host(url, &host, &port);
+    if (rc != 0) {
+        return rc;
+    }
+    spdtest_dns_result_t result;
+    memset(&result, 0, sizeof(result));
+    result.port = port;
+    result.cached = 1;
+    if (is_ip_address(host)) {
+        char literal[INET6_ADDRSTRLEN + 2];
+        snprintf(literal, sizeof(literal), strchr(host, ':') ? "[%s]" : "%s", host);
+        result.host = host;
+        result.addresses = literal;
+        cb(engine, &result, user_data);
+        free(host);
+        return 0;
+    }
+
+    dns_entry_t *entry = find_dns_entry(engine, host, port);
+    if (entry && entry->addresses && uv_hrtime() < entry->expires_ns) {
+        result.host = entry->host;
+        result.addresses = entry->addresses;
+        free(host);
+        cb(engine, &result, user_data);
+        return 0;
+    }
+    if (entry) {
+        free(host);
+    } else {
+        entry = calloc(1, sizeof(dns_entry_t));
+        if (!entry) {
+            free(host);
+            return UV_ENOMEM;
+        }
+        entry->engine = engine;
+        entry->host = host;
+        entry->port = port;
+        entry->next = engine->dns_cache;
+        engine->dns_cache = entry;
+    }
+    dns_waiter_t *waiter = malloc(sizeof(dns_waiter_t));
+    if (!waiter) {
+        return UV_ENOMEM;
+    }
+    waiter->cb = cb;
+    waiter->user_data = user_data;
+    waiter->next = NULL;
+    dns_waiter_t **tail = &entry->waiters;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = waiter;
+    if (!entry->resolving) {
+        entry->resolving = 1;
+        entry->lookup_start_ns = uv_hrtime();
+        rc = start_lookup(entry); // May answer before returning
+        if (rc != 0) {
+            entry->resolving = 0;
+            entry->waiters = NULL; // Only this waiter can be queued
+            free(waiter);
+            return rc;
+        }
+    }
+    return 0;
+}
+
+int spdtest_engine_pin_resolve(spdtest_engine_t *engine, CURL *easy_handle, const char *url) {
+    char *host = NULL;
+    int port = 0;
+    if (parse_url_host(url, &host, &port) != 0) {
+        return 0;
+    }
+    dns_entry_t *entry = find_dns_entry(engine, host, port);
+    free(host);
+    if (!entry || !entry->resolve || uv_hrtime() >= entry->expires_ns) {
+        return 0;
+    }
+    return curl_easy_setopt(easy_handle, CURLOPT_RESOLVE, entry->resolve) == CURLE_OK;
+}
+
+int spdtest_engine_set_dns_servers(spdtest_engine_t *engine, const char *servers) {
+#ifdef SPDTEST_HAVE_CARES
+    if (!engine->dns_channel_ready) {
+        int rc = create_dns_channel(engine);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return ares_status_to_uv(ares_set_servers_ports_csv(engine->dns_channel, servers));
+#else
+    (void)engine;
+    (void)servers;
+    return UV_ENOTSUP;
+#endif
+}
+
+void spdtest_engine_flush_dns(spdtest_engine_t *engine) {
+    for (dns_entry_t *entry = engine->dns_cache; entry; entry = entry->next) {
+        entry->expires_ns = 0;
+    }
+}
+
+void spdtest_engine_start(spdtest_engine_t *engine) {
+    engine->start_ns = uv_hrtime();
+    engine->bytes = 0;
+    engine->last_progress_ns = engine->start_ns;
+    engine->last_progress_bytes = 0;
+    if (engine->callbacks.on_progress && engine->callbacks.progress_interval_ms > 0) {
+        uv_timer_start(&engine->progress_timer, on_progress_timer, engine->callbacks.progress_interval_ms,
+                       engine->callbacks.progress_interval_ms);
+    }
+}
+
+int spdtest_engine_step(spdtest_engine_t *engine) {
+    uv_run(engine->loop, UV_RUN_ONCE);
+    return engine->num_transfers;
+}
+
+void spdtest_engine_run(spdtest_engine_t *engine) {
+    while (engine->num_transfers > 0) {
+        engine->in_run = 1;
+        int alive = uv_run(engine->loop, UV_RUN_DEFAULT);
+        engine->in_run = 0;
+        // uv_run returns 0 once nothing is left that could complete a transfer
+        if (alive == 0) {
+            break;
+        }
+    }
+}
+
+void spdtest_engine_stop(spdtest_engine_t *engine) {
+    uv_timer_stop(&engine->progress_timer);
+    int aborted = engine->num_transfers > 0;
+    while (engine->num_transfers > 0) {
+        engine_transfer_t transfer = engine->transfers[engine->num_transfers - 1];
+        engine->num_transfers--;
+        if (!transfer.pending) {
+            curl_multi_remove_handle(engine->multi, transfer.easy_handle);
+        }
+        // Already untracked: SPDTEST_TRANSFER_PENDING cannot keep it, the result is final
+        if (engine->callbacks.on_transfer_done) {
+            engine->callbacks.on_transfer_done(engine, transfer.easy_handle, CURLE_ABORTED_BY_CALLBACK,
+                                               engine->callbacks.user_data);
+        }
+    }
+    if (aborted) {
+        check_idle(engine);
+    }
+}
+// --- End Public API ---
+
+// --- Benchmark Hooks ---
+// See spdtest_internal.h
+void *spdtest_engine_open_socket(spdtest_engine_t *engine, curl_socket_t sockfd) {
+    engine_socket_t *socket_ctx = new_socket_context(engine, sockfd);
+    if (socket_ctx && engine->callbacks.on_socket_open) {
+        engine->callbacks.on_socket_open(engine, &socket_ctx->socket, engine->callbacks.user_data);
+    }
+    return socket_ctx;
+}
+
+int spdtest_engine_update_socket(spdtest_engine_t *engine, void *socket_ctx, int action) {
+    return handle_curl_socket(NULL, ((engine_socket_t *)socket_ctx)->socket.sockfd, action, engine, socket_ctx);
+}
+
+void spdtest_engine_close_socket(spdtest_engine_t *engine, void *socket_ctx) {
+    close_socket_context(engine, socket_ctx);
+}
+
+void spdtest_engine_harvest(spdtest_engine_t *engine) {
+    harvest_completions(engine);
+}
+
+void spdtest_engine_set_timeout_mode(spdtest_engine_t *engine, int mode) {
+    engine->timeout_mode = mode;
+}
+
+void spdtest_engine_get_counters(const spdtest_engine_t *engine, spdtest_engine_counters_t *counters) {
+    *counters = engine->counters;
+}
+// --- End Benchmark Hooks ---
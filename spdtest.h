@@ -0,0 +1,135 @@
+// libspdtest: the libuv/libcurl transfer engine of the speed test client.
+//
+// An engine drives one curl multi handle from a libuv loop: it polls libcurl's sockets, runs its
+// timeouts, harvests completed transfers once per loop iteration and counts the transfers that
+// are still running. All of its state lives in the engine, so any number of engines can run in
+// one process, on one shared loop or on loops of their own (one loop per thread). The caller
+// configures the easy handles; the engine only runs them.
+//
+// The engine can also resolve hostnames on its loop ahead of the transfers, with c-ares when the
+// library is built with it (SPDTEST_HAVE_CARES) and libuv's threadpool otherwise, and pin the
+// cached answers on easy handles so libcurl does not resolve them again.
+//
+// curl_global_init must be called once by the process before the first engine is created.
+#ifndef SPDTEST_H
+#define SPDTEST_H
+
+#include <curl/curl.h>
+#include <uv.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct spdtest_engine_s spdtest_engine_t;
+
+// A socket polled for libcurl. data is NULL when the socket is opened and belongs to the socket
+// hooks from then on.
+typedef struct {
+    curl_socket_t sockfd;
+    void *data;
+} spdtest_socket_t;
+
+// Reported every progress_interval_ms between spdtest_engine_start and spdtest_engine_stop
+typedef struct {
+    int running_transfers;
+    long long bytes; // Counted with spdtest_engine_count_bytes since spdtest_engine_start
+    double elapsed_s;
+    double interval_mbps; // Rate since the previous report
+} spdtest_progress_t;
+
+// Answer to spdtest_engine_resolve
+typedef struct {
+    const char *host;
+    int port;
+    int status; // 0, or a libuv error code (UV_EAI_NONAME, UV_ETIMEDOUT, UV_ECANCELED, ...)
+    const char *addresses; // Comma separated, IPv6 in brackets; NULL when the lookup failed
+    double lookup_ms; // Duration of the lookup, 0 when none was made
+    int cached; // Answered from the engine's DNS cache, or the host is an IP address
+} spdtest_dns_result_t;
+
+typedef void (*spdtest_resolve_cb)(spdtest_engine_t *engine, const spdtest_dns_result_t *result, void *user_data);
+
+// Return values of on_transfer_done
+#define SPDTEST_TRANSFER_DONE 0
+#define SPDTEST_TRANSFER_PENDING 1 // Still counted as running; see spdtest_engine_resume
+
+typedef struct {
+    // A transfer completed. The easy handle has been removed from the multi handle and belongs to
+    // the caller again; the callback may add new transfers. Returning SPDTEST_TRANSFER_PENDING
+    // keeps it counted as running until it is resumed or dropped, e.g. while waiting to retry.
+    int (*on_transfer_done)(spdtest_engine_t *engine, CURL *easy_handle, CURLcode result, void *user_data);
+    void (*on_progress)(spdtest_engine_t *engine, const spdtest_progress_t *progress, void *user_data);
+    // The last running transfer completed, was dropped or removed
+    void (*on_idle)(spdtest_engine_t *engine, void *user_data);
+    // Socket hooks. on_socket_update runs whenever libcurl changes what it waits for, the first
+    // time right after on_socket_open; on_socket_close runs while the socket is still open.
+    void (*on_socket_open)(spdtest_engine_t *engine, spdtest_socket_t *socket, void *user_data);
+    void (*on_socket_update)(spdtest_engine_t *engine, spdtest_socket_t *socket, void *user_data);
+    void (*on_socket_close)(spdtest_engine_t *engine, spdtest_socket_t *socket, void *user_data);
+    unsigned int progress_interval_ms; // 0 disables on_progress
+    void *user_data;
+} spdtest_callbacks_t;
+
+// Creates an engine on the caller's loop, or on a loop of its own when loop is NULL. Callbacks
+// may be NULL. Returns NULL on failure.
+spdtest_engine_t *spdtest_engine_create(uv_loop_t *loop, const spdtest_callbacks_t *callbacks);
+// Aborts the running transfers (see spdtest_engine_stop) and frees the engine once its handles
+// have closed. An engine with its own loop closes it here; on the caller's loop the memory is
+// released by the next loop iteration.
+void spdtest_engine_destroy(spdtest_engine_t *engine);
+
+uv_loop_t *spdtest_engine_loop(const spdtest_engine_t *engine);
+// For curl_multi_setopt, e.g. CURLMOPT_MAX_HOST_CONNECTIONS. The socket and timer callbacks
+// belong to the engine.
+CURLM *spdtest_engine_multi(const spdtest_engine_t *engine);
+int spdtest_engine_running(const spdtest_engine_t *engine);
+
+// Starts a transfer. Returns the result of curl_multi_add_handle, CURLM_OUT_OF_MEMORY when the
+// engine could not track it; nothing is started unless CURLM_OK is returned.
+CURLMcode spdtest_engine_add(spdtest_engine_t *engine, CURL *easy_handle);
+// Re-adds a transfer left pending by on_transfer_done. A transfer that cannot be re-added is
+// dropped; CURLM_BAD_EASY_HANDLE is returned for a transfer that is not pending.
+CURLMcode spdtest_engine_resume(spdtest_engine_t *engine, CURL *easy_handle);
+// Gives up a pending transfer
+void spdtest_engine_drop(spdtest_engine_t *engine, CURL *easy_handle);
+// Cancels a running transfer without calling on_transfer_done
+void spdtest_engine_remove(spdtest_engine_t *engine, CURL *easy_handle);
+// Adds transferred bytes to the progress reports, typically from a write or read callback
+void spdtest_engine_count_bytes(spdtest_engine_t *engine, long long bytes);
+
+// Resolves the host of url on the engine's loop and keeps the answer in the engine's DNS cache for
+// its TTL. Lookups of a host already in flight are joined. cb runs from the loop, or before this
+// returns for a cache hit or an IP address. Returns 0, or a libuv error code when no lookup could
+// be started; cb is not called then. Lookups still in flight when the engine is destroyed end
+// with UV_ECANCELED.
+int spdtest_engine_resolve(spdtest_engine_t *engine, const char *url, spdtest_resolve_cb cb, void *user_data);
+// Pins the cached answer for the host of url on easy_handle with CURLOPT_RESOLVE, so libcurl does
+// not resolve the host itself. The pinned list belongs to the engine and is refreshed in place by
+// later lookups; transfers must start before the engine is destroyed. Returns 1 when an answer
+// was pinned, 0 when the cache has no fresh one.
+int spdtest_engine_pin_resolve(spdtest_engine_t *engine, CURL *easy_handle, const char *url);
+// Name servers for the engine's lookups, "ip[:port],..." (c-ares only, UV_ENOTSUP otherwise).
+// Returns 0 or a libuv error code.
+int spdtest_engine_set_dns_servers(spdtest_engine_t *engine, const char *servers);
+// Expires every cached answer; the next spdtest_engine_resolve of a host looks it up again
+void spdtest_engine_flush_dns(spdtest_engine_t *engine);
+
+// Begins a measured phase: resets the progress counters and starts the progress reports
+void spdtest_engine_start(spdtest_engine_t *engine);
+// Runs one iteration of the loop, waiting for I/O if needed. Returns the running transfers.
+int spdtest_engine_step(spdtest_engine_t *engine);
+// Runs the loop until no transfer is running, or nothing is left that could complete one
+void spdtest_engine_run(spdtest_engine_t *engine);
+// Ends the phase: stops the progress reports and aborts the running transfers, which are
+// reported to on_transfer_done with CURLE_ABORTED_BY_CALLBACK. Pending transfers are reported
+// too. The return value of on_transfer_done is ignored here: the transfers are no longer tracked,
+// so one kept for a retry must not be resumed (spdtest_engine_resume returns
+// CURLM_BAD_EASY_HANDLE) and is cleaned up by the caller.
+void spdtest_engine_stop(spdtest_engine_t *engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SPDTEST_H
@@ -0,0 +1,48 @@
+// Entry points into the internals of libspdtest for spdtest-bench, which times the engine's
+// socket callback and completion sweep directly, and for spdtest-stress, which runs connection
+// bursts through the engine with each way of handling libcurl's zero-ms timeouts. Not part of
+// the library API (spdtest.h): they follow the engine's internals and may change with them.
+#ifndef SPDTEST_INTERNAL_H
+#define SPDTEST_INTERNAL_H
+
+#include "spdtest.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Polls sockfd as the engine does for a socket libcurl opened, on_socket_open included, but
+// without telling libcurl. Returns the socket's context, NULL on failure.
+void *spdtest_engine_open_socket(spdtest_engine_t *engine, curl_socket_t sockfd);
+// Passes what libcurl waits for on the socket (CURL_POLL_IN, CURL_POLL_OUT, ...) to the engine,
+// as libcurl's socket callback does. Returns the callback's result.
+int spdtest_engine_update_socket(spdtest_engine_t *engine, void *socket_ctx, int action);
+// Stops polling the socket and frees its context with the next loop iteration
+void spdtest_engine_close_socket(spdtest_engine_t *engine, void *socket_ctx);
+// Runs the completion sweep the engine makes once per loop iteration
+void spdtest_engine_harvest(spdtest_engine_t *engine);
+
+// Ways of running libcurl's zero-ms timeouts, see spdtest_engine_set_timeout_mode
+#define SPDTEST_TIMEOUT_DEFER 0 // From an idle handle on the next loop turn, coalesced (the default)
+#define SPDTEST_TIMEOUT_TIMER 1 // From a 1 ms timer
+#define SPDTEST_TIMEOUT_SYNC 2 // Right away, from inside libcurl's timer callback, which libcurl refuses
+
+// Counts of the engine's bridge since it was created
+typedef struct {
+    long long socket_actions; // curl_multi_socket_action calls from the loop
+    long long zero_timeouts; // Zero-ms timeouts requested by libcurl
+    long long kicks; // Deferred actions that ran, < zero_timeouts when requests were coalesced
+    long long recursive_calls; // Actions libcurl refused with CURLM_RECURSIVE_API_CALL
+    long long harvests; // Completion sweeps
+} spdtest_engine_counters_t;
+
+// Selects how the engine runs libcurl's zero-ms timeouts. Only SPDTEST_TIMEOUT_DEFER is safe;
+// the others exist to be compared with it.
+void spdtest_engine_set_timeout_mode(spdtest_engine_t *engine, int mode);
+void spdtest_engine_get_counters(const spdtest_engine_t *engine, spdtest_engine_counters_t *counters);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SPDTEST_INTERNAL_H
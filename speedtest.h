@@ -0,0 +1,54 @@
+// Internal interface of the speed test client (test.c). speedtest_main.c runs its command line,
+// and spdtest-bench drives its transfer callbacks directly, so the benchmarks time the client's
+// own code. Not a stable API: it follows test.c.
+#ifndef SPEEDTEST_H
+#define SPEEDTEST_H
+
+#include <stddef.h>
+#include "spdtest.h"
+
+#define SPEEDTEST_MAX_CONNECTIONS 4096 // -c; bounded by RLIMIT_NOFILE, raised by each throughput test as needed
+
+// Kinds of speedtest_stream_create
+#define SPEEDTEST_STREAM_DOWNLOAD 0
+#define SPEEDTEST_STREAM_UPLOAD 1 // Sends a fixed payload
+#define SPEEDTEST_STREAM_UPLOAD_RING 2 // Sends from the payload ring, see speedtest_set_open_ended_uploads
+
+typedef struct speedtest_stream_s speedtest_stream_t;
+
+// The command line of the speed test client
+int speedtest_main(int argc, char *argv[]);
+
+// Sets the client up on loop as for its tests, with its transfer engine and room for
+// max_connections, but without retries, so every failed transfer is counted. curl_global_init
+// must have been called. Returns the engine, NULL on failure.
+spdtest_engine_t *speedtest_client_init(uv_loop_t *loop, int max_connections);
+// Destroys the engine and closes the client's timers; run the loop once more afterwards
+void speedtest_client_cleanup(void);
+// Transfers that failed since the previous call
+int speedtest_take_failed_transfers(void);
+// Makes the read callback stream open-ended uploads without a deadline, or fixed payloads again
+void speedtest_set_open_ended_uploads(int enabled);
+// Parses a byte count with an optional K, M or G suffix, as --upload-bytes does
+int speedtest_parse_size(const char *text, long long *bytes);
+
+// A stream set up as the tests do, without rate limits, budgets or bindings. Uploads send zeros:
+// payload_size bytes (the client's default payload when 0), or the payload ring. With
+// count_per_server the bytes are also counted for a server, as in a striped test. Returns NULL
+// when out of memory.
+speedtest_stream_t *speedtest_stream_create(int kind, size_t payload_size, int count_per_server);
+// Another stream like stream that sends the same payload, as the connections of a test share
+// theirs. Free it before stream. Returns NULL when out of memory.
+speedtest_stream_t *speedtest_stream_share(const speedtest_stream_t *stream);
+void speedtest_stream_free(speedtest_stream_t *stream);
+// Bytes received or sent
+long long speedtest_stream_bytes(const speedtest_stream_t *stream);
+// Starts an upload over once its payload was sent in full
+void speedtest_stream_rewind(speedtest_stream_t *stream);
+
+// The client's libcurl callbacks (CURLOPT_WRITEFUNCTION, CURLOPT_READFUNCTION); the stream is
+// their user data
+size_t speedtest_download_write(char *ptr, size_t size, size_t nmemb, void *stream);
+size_t speedtest_upload_read(char *buffer, size_t size, size_t nitems, void *stream);
+
+#endif // SPEEDTEST_H
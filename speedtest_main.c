@@ -0,0 +1,6 @@
+// Command line of the speed test client; the client itself is test.c, which spdtest-bench links too
+#include "speedtest.h"
+
+int main(int argc, char *argv[]) {
+    return speedtest_main(argc, argv);
+}
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <curl/curl.h>
+#include <uv.h>
+#include "spdtest.h"
+#include "spdtest_internal.h"
+
+// Connection burst benchmark. Starts a small HTTP server on a loopback port and, on the same
+// event loop, adds thousands of transfers at once to a libspdtest engine, the transfer engine
+// main.c and test.c run on. The burst is repeated for each way the engine can handle libcurl's
+// zero-ms timeouts (spdtest_engine_set_timeout_mode):
+//
+//   defer  run the action from an idle handle on the next loop turn, coalescing repeated
+//          requests into one (the engine's default)
+//   timer  run it from a 1 ms timer
+//   sync   call curl_multi_socket_action right away, from inside libcurl's timer callback
+//
+// libcurl refuses the nested call of "sync" with CURLM_RECURSIVE_API_CALL, so requests get lost
+// and transfers can stall until the next unrelated event; the engine's counters make that
+// visible.
+
+#define DEFAULT_CONNECTIONS 2000
+#define DEFAULT_RESPONSE_BYTES (16 * 1024)
+#define MAX_RESPONSE_BYTES (1024LL * 1024 * 1024)
+#define RUN_TIME_LIMIT_MS 10000 // A stalled burst is cut off and reported
+#define SERVER_BACKLOG 4096
+#define REQUEST_BUFFER_SIZE 4096
+
+// Indexed by the SPDTEST_TIMEOUT_* modes
+static const char *mode_names[] = {"defer", "timer", "sync"};
+
+// Counters of one burst
+typedef struct {
+    int completed;
+    int failed;
+    long long bytes;
+    spdtest_engine_counters_t engine; // The engine's bridge counters
+    int stalled; // Cut off by RUN_TIME_LIMIT_MS
+    double seconds;
+} burst_stats_t;
+
+typedef struct {
+    uv_tcp_t handle;
+    char request[REQUEST_BUFFER_SIZE];
+    size_t request_len;
+    uv_write_t write_req;
+    uv_buf_t bufs[2];
+    int responded;
+} server_client_t;
+
+static uv_loop_t *loop;
+static spdtest_engine_t *engine; // Of the running burst
+static uv_timer_t limit_timer;
+static uv_tcp_t server;
+static int server_port;
+static char *response_body;
+static size_t response_bytes = DEFAULT_RESPONSE_BYTES;
+static char response_header[128];
+static burst_stats_t stats;
+
+// --- Loopback server ---
+
+static void on_client_closed(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static void on_response_written(uv_write_t *req, int status) {
+    server_client_t *client = req->data;
+    uv_close((uv_handle_t *)&client->handle, on_client_closed);
+}
+
+static void on_server_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    server_client_t *client = handle->data;
+    buf->base = client->request + client->request_len;
+    buf->len = sizeof(client->request) - client->request_len - 1;
+}
+
+// Every request gets the same response; the connection is closed once it is written
+static void on_server_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    server_client_t *client = stream->data;
+    if (nread < 0 || (nread == 0 && client->request_len == sizeof(client->request) - 1)) {
+        if (!uv_is_closing((uv_handle_t *)stream)) {
+            uv_close((uv_handle_t *)stream, on_client_closed);
+        }
+        return;
+    }
+    client->request_len += nread;
+    client->request[client->request_len] = '\0';
+    if (client->responded || !strstr(client->request, "\r\n\r\n")) {
+        return;
+    }
+    client->responded = 1;
+    uv_read_stop(stream);
+    client->bufs[0] = uv_buf_init(response_header, strlen(response_header));
+    client->bufs[1] = uv_buf_init(response_body, response_bytes);
+    client->write_req.data = client;
+    uv_write(&client->write_req, stream, client->bufs, 2, on_response_written);
+}
+
+static void on_server_connection(uv_stream_t *listener, int status) {
+    if (status < 0) {
+        return;
+    }
+    server_client_t *client = calloc(1, sizeof(*client));
+    if (!client) {
+        return;
+    }
+    uv_tcp_init(loop, &client->handle);
+    client->handle.data = client;
+    if (uv_accept(listener, (uv_stream_t *)&client->handle) != 0) {
+        uv_close((uv_handle_t *)&client->handle, on_client_closed);
+        return;
+    }
+    uv_read_start((uv_stream_t *)&client->handle, on_server_alloc, on_server_read);
+}
+
+static int start_server(void) {
+    struct sockaddr_in addr;
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    uv_tcp_init(loop, &server);
+    int rc = uv_tcp_bind(&server, (const struct sockaddr *)&addr, 0);
+    if (rc == 0) {
+        rc = uv_listen((uv_stream_t *)&server, SERVER_BACKLOG, on_server_connection);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Error: Failed to start the loopback server: %s\n", uv_strerror(rc));
+        return -1;
+    }
+    struct sockaddr_in bound;
+    int len = sizeof(bound);
+    uv_tcp_getsockname(&server, (struct sockaddr *)&bound, &len);
+    server_port = ntohs(bound.sin_port);
+    snprintf(response_header, sizeof(response_header),
+             "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", response_bytes);
+    return 0;
+}
+
+// --- End Loopback server ---
+
+// --- Engine callbacks ---
+
+static int on_transfer_done(spdtest_engine_t *done_engine, CURL *easy_handle, CURLcode result, void *user_data) {
+    if (result == CURLE_OK) {
+        stats.completed++;
+    } else {
+        stats.failed++;
+    }
+    curl_easy_cleanup(easy_handle);
+    return SPDTEST_TRANSFER_DONE;
+}
+
+static size_t on_curl_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    stats.bytes += (long long)(size * nmemb);
+    return size * nmemb;
+}
+
+// --- End Engine callbacks ---
+
+// Cut off: the engine aborts what is left, which on_transfer_done counts as failed
+static void on_run_limit(uv_timer_t *timer) {
+    stats.stalled = 1;
+    spdtest_engine_stop(engine);
+}
+
+// Adds every transfer at once to a new engine and runs it until all of them completed. Every
+// burst gets an engine of its own, so it starts with fresh counters and no cached connections.
+static int run_burst(int mode, int connections) {
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/", server_port);
+    memset(&stats, 0, sizeof(stats));
+
+    spdtest_callbacks_t callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.on_transfer_done = on_transfer_done;
+    engine = spdtest_engine_create(loop, &callbacks);
+    if (!engine) {
+        fprintf(stderr, "Error: Failed to create the transfer engine.\n");
+        return -1;
+    }
+    spdtest_engine_set_timeout_mode(engine, mode);
+
+    uint64_t start_ns = uv_hrtime();
+    for (int i = 0; i < connections; ++i) {
+        CURL *easy = curl_easy_init();
+        if (!easy) {
+            stats.failed++;
+            continue;
+        }
+        curl_easy_setopt(easy, CURLOPT_URL, url);
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, on_curl_write);
+        curl_easy_setopt(easy, CURLOPT_FORBID_REUSE, 1L);
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, (long)RUN_TIME_LIMIT_MS);
+        if (spdtest_engine_add(engine, easy) != CURLM_OK) {
+            stats.failed++;
+            curl_easy_cleanup(easy);
+        }
+    }
+    uv_timer_start(&limit_timer, on_run_limit, RUN_TIME_LIMIT_MS, 0);
+    spdtest_engine_run(engine);
+    uv_timer_stop(&limit_timer);
+    stats.seconds = (uv_hrtime() - start_ns) / 1e9;
+
+    spdtest_engine_get_counters(engine, &stats.engine);
+    // Aborts any transfer left when nothing could complete it any more, counted as failed
+    spdtest_engine_destroy(engine);
+    engine = NULL;
+    uv_run(loop, UV_RUN_NOWAIT); // Let the poll handles of the closed sockets and the engine go
+    return 0;
+}
+
+static void print_burst(const char *name, int connections) {
+    printf("%-6s %7d %7d %8.3f %9.0f %9lld %8lld %8lld %9lld %8lld  %s\n", name, stats.completed, stats.failed, stats.seconds,
+           stats.seconds > 0.0 ? stats.completed / stats.seconds : 0.0, stats.engine.socket_actions, stats.engine.zero_timeouts,
+           stats.engine.kicks, stats.engine.recursive_calls, stats.engine.harvests,
+           stats.stalled ? "STALLED" : (stats.completed == connections ? "ok" : "errors"));
+}
+
+static int raise_fd_limit(int connections) {
+    struct rlimit limit;
+    rlim_t wanted = (rlim_t)connections * 2 + 64; // Client and server end of every connection
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return -1;
+    }
+    if (limit.rlim_cur < wanted) {
+        limit.rlim_cur = wanted <= limit.rlim_max ? wanted : limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    return limit.rlim_cur >= wanted ? 0 : -1;
+}
+
+static void print_usage(const char *prog_name) {
+    printf("Usage: %s [options]\n", prog_name);
+    printf("Opens a burst of connections to a loopback server on one event loop and compares the ways\n");
+    printf("of handling libcurl's zero-ms timeouts.\n");
+    printf("Options:\n");
+    printf("  -n, --connections <N>  Transfers added at once. (Default: %d)\n", DEFAULT_CONNECTIONS);
+    printf("  -b, --bytes <N>        Response body size. (Default: %d)\n", DEFAULT_RESPONSE_BYTES);
+    printf("  -m, --mode <MODE>      defer, timer, sync or all. (Default: all)\n");
+    printf("  -r, --repeat <N>       Bursts per mode. (Default: 1)\n");
+    printf("  -h, --help             Display this help message.\n");
+}
+
+int main(int argc, char *argv[]) {
+    int connections = DEFAULT_CONNECTIONS;
+    int repeat = 1;
+    int first_mode = SPDTEST_TIMEOUT_DEFER;
+    int last_mode = SPDTEST_TIMEOUT_SYNC;
+
+    static struct option long_options[] = {
+        {"connections", required_argument, 0, 'n'},
+        {"bytes", required_argument, 0, 'b'},
+        {"mode", required_argument, 0, 'm'},
+        {"repeat", required_argument, 0, 'r'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:b:m:r:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                connections = atoi(optarg);
+                if (connections < 1) {
+                    fprintf(stderr, "Error: At least one connection is needed.\n");
+                    return 1;
+                }
+                break;
+            case 'b': {
+                char *end = NULL;
+                errno = 0;
+                long long bytes = strtoll(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' || bytes < 0 || bytes > MAX_RESPONSE_BYTES) {
+                    fprintf(stderr, "Error: Response size must be a number of bytes between 0 and %lld.\n", MAX_RESPONSE_BYTES);
+                    return 1;
+                }
+                response_bytes = (size_t)bytes;
+                break;
+            }
+            case 'm':
+                if (strcmp(optarg, "all") == 0) {
+                    first_mode = SPDTEST_TIMEOUT_DEFER;
+                    last_mode = SPDTEST_TIMEOUT_SYNC;
+                    break;
+                }
+                first_mode = -1;
+                for (int i = SPDTEST_TIMEOUT_DEFER; i <= SPDTEST_TIMEOUT_SYNC; ++i) {
+                    if (strcmp(optarg, mode_names[i]) == 0) {
+                        first_mode = last_mode = i;
+                    }
+                }
+                if (first_mode < 0) {
+                    fprintf(stderr, "Error: Unknown mode '%s'.\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'r':
+                repeat = atoi(optarg);
+                if (repeat < 1) {
+                    repeat = 1;
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (raise_fd_limit(connections) != 0) {
+        fprintf(stderr, "Warning: The file descriptor limit is too low for %d connections, some will fail.\n", connections);
+    }
+    response_body = calloc(1, response_bytes > 0 ? response_bytes : 1);
+    if (!response_body || curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+        fprintf(stderr, "Error: Initialization failed.\n");
+        return 1;
+    }
+    loop = uv_default_loop();
+    if (start_server() != 0) {
+        return 1;
+    }
+    uv_timer_init(loop, &limit_timer);
+    uv_unref((uv_handle_t *)&server); // The bursts keep the loop running, not the listener
+
+    printf("%d connections per burst, %zu byte responses from 127.0.0.1:%d\n\n", connections, response_bytes, server_port);
+    printf("%-6s %7s %7s %8s %9s %9s %8s %8s %9s %8s  %s\n", "mode", "done", "failed", "seconds", "conn/s",
+           "actions", "zero-ms", "kicks", "refused", "sweeps", "result");
+    for (int m = first_mode; m <= last_mode; ++m) {
+        for (int r = 0; r < repeat; ++r) {
+            if (run_burst(m, connections) != 0) {
+                return 1;
+            }
+            print_burst(mode_names[m], connections);
+        }
+    }
+    printf("\nkicks: deferred actions actually run; refused: nested curl_multi_socket_action calls rejected\n");
+    printf("with CURLM_RECURSIVE_API_CALL; sweeps: completion harvests.\n");
+
+    curl_global_cleanup();
+    uv_close((uv_handle_t *)&limit_timer, NULL);
+    uv_close((uv_handle_t *)&server, NULL);
+    uv_run(loop, UV_RUN_NOWAIT);
+    uv_loop_close(loop);
+    free(response_body);
+    return 0;
+}
@@ -0,0 +1,686 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <uv.h>
+
+// WAN emulation proxy. Listens on a local port, connects every accepted connection to the target
+// (typically the local test server) and forwards the bytes in both directions through release
+// queues: each chunk read from one side gets a departure time from the bandwidth cap and stall
+// windows of its direction, plus the one-way delay, jitter and loss penalty, and a timer writes
+// it to the other side once that time has come.
+//
+// A TCP proxy cannot drop bytes of a TCP stream. Loss is emulated the way the receiver sees it:
+// the segment and everything behind it in that direction is held back by the loss penalty
+// (a fast retransmit takes about one round trip), so goodput and latency react like on a lossy
+// path while the stream stays intact.
+
+#define READ_CHUNK_SIZE (64 * 1024)
+#define SEGMENT_SIZE 1448 // Loss is decided per segment of a chunk
+#define QUEUE_HIGH_WATERMARK (4 * 1024 * 1024) // Stop reading the source above this many queued bytes
+#define QUEUE_LOW_WATERMARK (1 * 1024 * 1024) // Resume reading below this
+
+typedef struct {
+    char *listen_addr;
+    int listen_port;
+    char *target_host;
+    int target_port;
+    double delay_ms; // One-way delay, applied in both directions
+    double jitter_ms; // Uniform +/- spread of the delay
+    double up_rate_mbps; // Client to server, 0 is unlimited
+    double down_rate_mbps; // Server to client, 0 is unlimited
+    double loss_pct; // Average segment loss
+    double loss_burst; // Mean number of consecutive lost segments, 1 is independent loss
+    double loss_penalty_ms; // Extra delay of a lost segment, < 0 means one round trip
+    double stall_every_s; // Period of link outages, 0 disables them
+    double stall_ms; // Length of each outage
+    unsigned int seed;
+    int verbose;
+    int help_flag;
+} wanem_config_t;
+
+// One direction of the emulated link, shared by all proxied connections
+typedef struct {
+    const char *name;
+    double rate_bytes_per_s; // 0 is unlimited
+    uint64_t next_free_ns; // When the bandwidth cap lets the next byte depart
+    int loss_bad_state; // Gilbert-Elliott state for bursty loss
+    long long bytes;
+    long long chunks;
+    long long lost_segments;
+    long long stalled_chunks;
+} link_direction_t;
+
+typedef struct chunk_s {
+    struct chunk_s *next;
+    uv_write_t write_req;
+    uint64_t release_ns;
+    size_t len; // 0 marks the end of the stream
+    char *data;
+    struct pipe_s *pipe;
+} chunk_t;
+
+struct connection_s;
+
+// Bytes flowing from src to dst of one connection
+typedef struct pipe_s {
+    struct connection_s *conn;
+    uv_stream_t *src;
+    uv_stream_t *dst;
+    link_direction_t *link;
+    chunk_t *head;
+    chunk_t *tail;
+    uint64_t last_release_ns; // Chunks never overtake each other
+    size_t queued_bytes; // Queued or being written
+    int reading;
+    int eof_queued;
+    uv_timer_t release_timer;
+} pipe_t;
+
+typedef struct connection_s {
+    uv_tcp_t client;
+    uv_tcp_t upstream;
+    uv_connect_t connect_req;
+    uv_shutdown_t shutdown_req[2];
+    int shutdowns_done;
+    pipe_t up; // client -> upstream
+    pipe_t down; // upstream -> client
+    int id;
+    int upstream_connected;
+    int closing;
+    int handles_open;
+    struct connection_s *next; // Open connections, closed on shutdown
+} connection_t;
+
+static uv_loop_t *loop;
+static uv_tcp_t listener;
+static uv_signal_t sigint_handle;
+static wanem_config_t config;
+static link_direction_t up_link = {.name = "up"};
+static link_direction_t down_link = {.name = "down"};
+static struct sockaddr_storage target_addr;
+static uint64_t start_ns;
+static int next_connection_id = 1;
+static int active_connections;
+static connection_t *connections;
+
+static void close_connection(connection_t *conn);
+static void pipe_start_reading(pipe_t *pipe);
+static void schedule_release(pipe_t *pipe);
+
+static double random_unit(void) {
+    return rand() / ((double)RAND_MAX + 1.0);
+}
+
+// Moves a departure time out of a stall window. Stalls start stall_every_s after startup.
+static uint64_t skip_stalls(uint64_t depart_ns, int *stalled) {
+    if (config.stall_every_s <= 0.0 || config.stall_ms <= 0.0) {
+        return depart_ns;
+    }
+    uint64_t period_ns = (uint64_t)(config.stall_every_s * 1e9);
+    uint64_t stall_ns = (uint64_t)(config.stall_ms * 1e6);
+    uint64_t since_start = depart_ns - start_ns;
+    uint64_t offset = since_start % period_ns;
+    if (since_start >= period_ns && offset < stall_ns) {
+        *stalled = 1;
+        return depart_ns + (stall_ns - offset);
+    }
+    return depart_ns;
+}
+
+// Number of lost segments in a chunk. Independent loss when loss_burst <= 1, otherwise a
+// Gilbert-Elliott chain whose bad state lasts loss_burst segments on average.
+static int count_lost_segments(link_direction_t *link, size_t len) {
+    if (config.loss_pct <= 0.0) {
+        return 0;
+    }
+    double loss = config.loss_pct / 100.0;
+    int segments = (int)((len + SEGMENT_SIZE - 1) / SEGMENT_SIZE);
+    int lost = 0;
+    if (config.loss_burst <= 1.0) {
+        for (int i = 0; i < segments; ++i) {
+            lost += random_unit() < loss;
+        }
+        return lost;
+    }
+    double leave_bad = 1.0 / config.loss_burst;
+    double enter_bad = loss * leave_bad / (1.0 - loss); // Keeps the long-run loss rate at loss_pct
+    for (int i = 0; i < segments; ++i) {
+        if (link->loss_bad_state) {
+            lost++;
+            link->loss_bad_state = random_unit() >= leave_bad;
+        } else {
+            link->loss_bad_state = random_unit() < enter_bad;
+        }
+    }
+    return lost;
+}
+
+// Computes when a chunk read now may be written to the other side
+static uint64_t release_time(pipe_t *pipe, size_t len) {
+    link_direction_t *link = pipe->link;
+    uint64_t now = uv_hrtime();
+    uint64_t depart = now > link->next_free_ns ? now : link->next_free_ns;
+    int stalled = 0;
+    depart = skip_stalls(depart, &stalled);
+    if (link->rate_bytes_per_s > 0.0) {
+        depart += (uint64_t)(len / link->rate_bytes_per_s * 1e9);
+        link->next_free_ns = depart;
+    }
+    link->stalled_chunks += stalled;
+
+    double delay_ms = config.delay_ms;
+    if (config.jitter_ms > 0.0) {
+        delay_ms += (random_unit() * 2.0 - 1.0) * config.jitter_ms;
+        if (delay_ms < 0.0) {
+            delay_ms = 0.0;
+        }
+    }
+    int lost = count_lost_segments(link, len);
+    if (lost > 0) {
+        double penalty_ms = config.loss_penalty_ms >= 0.0 ? config.loss_penalty_ms : 2.0 * config.delay_ms + 1.0;
+        delay_ms += penalty_ms;
+        link->lost_segments += lost;
+    }
+    uint64_t release = depart + (uint64_t)(delay_ms * 1e6);
+    if (release < pipe->last_release_ns) {
+        release = pipe->last_release_ns; // Jitter must not reorder a byte stream
+    }
+    pipe->last_release_ns = release;
+    return release;
+}
+
+static void enqueue_chunk(pipe_t *pipe, char *data, size_t len) {
+    chunk_t *chunk = calloc(1, sizeof(chunk_t));
+    if (!chunk) {
+        fprintf(stderr, "Error: Failed to allocate a chunk for connection %d.\n", pipe->conn->id);
+        free(data);
+        close_connection(pipe->conn);
+        return;
+    }
+    chunk->data = data;
+    chunk->len = len;
+    chunk->pipe = pipe;
+    chunk->release_ns = release_time(pipe, len);
+    if (pipe->tail) {
+        pipe->tail->next = chunk;
+    } else {
+        pipe->head = chunk;
+    }
+    pipe->tail = chunk;
+    pipe->queued_bytes += len;
+    pipe->link->bytes += len;
+    pipe->link->chunks++;
+
+    if (pipe->reading && pipe->queued_bytes > QUEUE_HIGH_WATERMARK) {
+        uv_read_stop(pipe->src); // Backpressure towards the sender, resumed in on_chunk_written
+        pipe->reading = 0;
+    }
+    if (pipe->head == chunk) {
+        schedule_release(pipe);
+    }
+}
+
+static void on_chunk_written(uv_write_t *req, int status) {
+    chunk_t *chunk = (chunk_t *)req->data;
+    pipe_t *pipe = chunk->pipe;
+    pipe->queued_bytes -= chunk->len;
+    free(chunk->data);
+    free(chunk);
+    if (status < 0) {
+        if (status != UV_ECANCELED && config.verbose) {
+            fprintf(stderr, "Connection %d: write failed: %s\n", pipe->conn->id, uv_strerror(status));
+        }
+        close_connection(pipe->conn);
+        return;
+    }
+    if (!pipe->reading && !pipe->eof_queued && !pipe->conn->closing && pipe->queued_bytes < QUEUE_LOW_WATERMARK) {
+        pipe_start_reading(pipe);
+    }
+}
+
+static void on_shutdown(uv_shutdown_t *req, int status) {
+    connection_t *conn = (connection_t *)req->data;
+    if (status < 0 && config.verbose) {
+        fprintf(stderr, "Connection %d: shutdown failed: %s\n", conn->id, uv_strerror(status));
+    }
+    // Both directions half-closed after their last write: nothing more can flow
+    if (++conn->shutdowns_done == 2) {
+        close_connection(conn);
+    }
+}
+
+// Writes every chunk whose release time has come, then rearms the timer for the next one
+static void on_release_timer(uv_timer_t *timer) {
+    pipe_t *pipe = (pipe_t *)((char *)timer - offsetof(pipe_t, release_timer));
+    uint64_t now = uv_hrtime();
+    while (pipe->head && pipe->head->release_ns <= now + 500000) { // Timers have millisecond resolution
+        chunk_t *chunk = pipe->head;
+        pipe->head = chunk->next;
+        if (!pipe->head) {
+            pipe->tail = NULL;
+        }
+        if (chunk->len == 0) { // End of stream: forward the half-close
+            free(chunk);
+            uv_shutdown_t *req = pipe == &pipe->conn->up ? &pipe->conn->shutdown_req[0] : &pipe->conn->shutdown_req[1];
+            req->data = pipe->conn;
+            if (uv_shutdown(req, pipe->dst, on_shutdown) != 0) {
+                close_connection(pipe->conn);
+                return;
+            }
+            continue;
+        }
+        uv_buf_t buf = uv_buf_init(chunk->data, (unsigned int)chunk->len);
+        chunk->write_req.data = chunk;
+        int rc = uv_write(&chunk->write_req, pipe->dst, &buf, 1, on_chunk_written);
+        if (rc != 0) {
+            fprintf(stderr, "Connection %d: uv_write failed: %s\n", pipe->conn->id, uv_strerror(rc));
+            pipe->queued_bytes -= chunk->len;
+            free(chunk->data);
+            free(chunk);
+            close_connection(pipe->conn);
+            return;
+        }
+    }
+    schedule_release(pipe);
+}
+
+static void schedule_release(pipe_t *pipe) {
+    if (!pipe->head || pipe->conn->closing) {
+        return;
+    }
+    uint64_t now = uv_hrtime();
+    uint64_t wait_ms = pipe->head->release_ns > now ? (pipe->head->release_ns - now + 999999) / 1000000 : 0;
+    uv_timer_start(&pipe->release_timer, on_release_timer, wait_ms, 0);
+}
+
+static void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    buf->base = malloc(READ_CHUNK_SIZE);
+    buf->len = buf->base ? READ_CHUNK_SIZE : 0;
+}
+
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    connection_t *conn = (connection_t *)stream->data;
+    pipe_t *pipe = stream == (uv_stream_t *)&conn->client ? &conn->up : &conn->down;
+    if (nread > 0) {
+        enqueue_chunk(pipe, buf->base, (size_t)nread); // The chunk owns the buffer now
+        return;
+    }
+    free(buf->base);
+    if (nread == 0) {
+        return; // EAGAIN
+    }
+    if (nread == UV_EOF) {
+        uv_read_stop(stream);
+        pipe->reading = 0;
+        pipe->eof_queued = 1;
+        enqueue_chunk(pipe, NULL, 0); // The half-close travels with the same delay as the data
+        return;
+    }
+    if (config.verbose) {
+        fprintf(stderr, "Connection %d: read failed: %s\n", conn->id, uv_strerror((int)nread));
+    }
+    close_connection(conn);
+}
+
+static void pipe_start_reading(pipe_t *pipe) {
+    int rc = uv_read_start(pipe->src, alloc_buffer, on_read);
+    if (rc != 0) {
+        fprintf(stderr, "Connection %d: uv_read_start failed: %s\n", pipe->conn->id, uv_strerror(rc));
+        close_connection(pipe->conn);
+        return;
+    }
+    pipe->reading = 1;
+}
+
+static void on_handle_closed(uv_handle_t *handle) {
+    connection_t *conn = (connection_t *)handle->data;
+    if (--conn->handles_open == 0) {
+        if (config.verbose) {
+            printf("Connection %d closed\n", conn->id);
+        }
+        for (connection_t **link = &connections; *link; link = &(*link)->next) {
+            if (*link == conn) {
+                *link = conn->next;
+                break;
+            }
+        }
+        free(conn);
+        active_connections--;
+    }
+}
+
+static void free_queue(pipe_t *pipe) {
+    // Chunks being written are freed by on_chunk_written with UV_ECANCELED
+    while (pipe->head) {
+        chunk_t *chunk = pipe->head;
+        pipe->head = chunk->next;
+        free(chunk->data);
+        free(chunk);
+    }
+    pipe->tail = NULL;
+}
+
+static void close_connection(connection_t *conn) {
+    if (conn->closing) {
+        return;
+    }
+    conn->closing = 1;
+    free_queue(&conn->up);
+    free_queue(&conn->down);
+    uv_close((uv_handle_t *)&conn->up.release_timer, on_handle_closed);
+    uv_close((uv_handle_t *)&conn->down.release_timer, on_handle_closed);
+    uv_close((uv_handle_t *)&conn->client, on_handle_closed);
+    uv_close((uv_handle_t *)&conn->upstream, on_handle_closed);
+}
+
+static void on_upstream_connected(uv_connect_t *req, int status) {
+    connection_t *conn = (connection_t *)req->data;
+    if (conn->closing) {
+        return;
+    }
+    if (status < 0) {
+        fprintf(stderr, "Connection %d: connecting to %s:%d failed: %s\n", conn->id, config.target_host,
+                config.target_port, uv_strerror(status));
+        close_connection(conn);
+        return;
+    }
+    conn->upstream_connected = 1;
+    uv_tcp_nodelay(&conn->upstream, 1); // Chunk timing is decided here, not by Nagle
+    pipe_start_reading(&conn->up);
+    pipe_start_reading(&conn->down);
+}
+
+static void init_pipe(pipe_t *pipe, connection_t *conn, uv_stream_t *src, uv_stream_t *dst, link_direction_t *link) {
+    pipe->conn = conn;
+    pipe->src = src;
+    pipe->dst = dst;
+    pipe->link = link;
+    uv_timer_init(loop, &pipe->release_timer);
+    pipe->release_timer.data = conn;
+}
+
+static void on_new_connection(uv_stream_t *server, int status) {
+    if (status < 0) {
+        fprintf(stderr, "Error: Accepting a connection failed: %s\n", uv_strerror(status));
+        return;
+    }
+    connection_t *conn = calloc(1, sizeof(connection_t));
+    if (!conn) {
+        fprintf(stderr, "Error: Failed to allocate a connection.\n");
+        return;
+    }
+    conn->id = next_connection_id++;
+    uv_tcp_init(loop, &conn->client);
+    uv_tcp_init(loop, &conn->upstream);
+    conn->client.data = conn;
+    conn->upstream.data = conn;
+    init_pipe(&conn->up, conn, (uv_stream_t *)&conn->client, (uv_stream_t *)&conn->upstream, &up_link);
+    init_pipe(&conn->down, conn, (uv_stream_t *)&conn->upstream, (uv_stream_t *)&conn->client, &down_link);
+    conn->handles_open = 4;
+    conn->next = connections;
+    connections = conn;
+    active_connections++;
+
+    if (uv_accept(server, (uv_stream_t *)&conn->client) != 0) {
+        close_connection(conn);
+        return;
+    }
+    uv_tcp_nodelay(&conn->client, 1);
+    if (config.verbose) {
+        printf("Connection %d accepted\n", conn->id);
+    }
+    conn->connect_req.data = conn;
+    int rc = uv_tcp_connect(&conn->connect_req, &conn->upstream, (const struct sockaddr *)&target_addr, on_upstream_connected);
+    if (rc != 0) {
+        fprintf(stderr, "Connection %d: uv_tcp_connect failed: %s\n", conn->id, uv_strerror(rc));
+        close_connection(conn);
+    }
+}
+
+static void print_link_stats(const link_direction_t *link) {
+    double elapsed_s = (uv_hrtime() - start_ns) / 1e9;
+    long long segments = link->bytes / SEGMENT_SIZE + link->chunks;
+    printf("  %-4s %lld bytes in %lld chunks (%.2f Mbps average), %lld segment(s) lost (~%.2f%%), %lld chunk(s) stalled\n",
+           link->name, link->bytes, link->chunks, elapsed_s > 0.0 ? link->bytes * 8.0 / elapsed_s / 1e6 : 0.0,
+           link->lost_segments, segments > 0 ? link->lost_segments * 100.0 / segments : 0.0, link->stalled_chunks);
+}
+
+static void on_signal(uv_signal_t *handle, int signum) {
+    printf("\nShutting down (%d connection(s) open).\n", active_connections);
+    printf("Link statistics:\n");
+    print_link_stats(&up_link);
+    print_link_stats(&down_link);
+    for (connection_t *conn = connections; conn; conn = conn->next) {
+        close_connection(conn);
+    }
+    uv_close((uv_handle_t *)&listener, NULL);
+    uv_close((uv_handle_t *)&sigint_handle, NULL);
+}
+
+static void print_usage(const char *prog_name) {
+    printf("Usage: %s -t <HOST:PORT> [options]\n", prog_name);
+    printf("Forwards TCP connections to the target through an emulated WAN link.\n");
+    printf("Options:\n");
+    printf("  -t, --target <HOST:PORT> Address to forward connections to (e.g. the local test server).\n");
+    printf("  -a, --listen-addr <IP> Address to listen on. (Default: 127.0.0.1)\n");
+    printf("  -p, --listen-port <N>  Port to listen on. (Default: 18000)\n");
+    printf("  -d, --delay <MS>       One-way delay in each direction, the RTT is twice this. (Default: 0)\n");
+    printf("  -j, --jitter <MS>      Uniform +/- spread of the delay; bytes are never reordered. (Default: 0)\n");
+    printf("  -r, --rate <MBPS>      Bandwidth cap in both directions. (Default: unlimited)\n");
+    printf("      --up-rate <MBPS>   Bandwidth cap from client to target.\n");
+    printf("      --down-rate <MBPS> Bandwidth cap from target to client.\n");
+    printf("  -L, --loss <PCT>       Average segment loss in percent. (Default: 0)\n");
+    printf("      --loss-burst <N>   Mean length of a loss burst in segments; 1 is random loss. (Default: 1)\n");
+    printf("      --loss-penalty <MS> Delay added by a lost segment. (Default: one round trip)\n");
+    printf("      --stall-every <SEC> Take the link down periodically. (Default: never)\n");
+    printf("      --stall <MS>       Length of each outage. (Default: 500)\n");
+    printf("      --seed <N>         Seed of the random generator, for reproducible runs.\n");
+    printf("  -v, --verbose          Log every connection.\n");
+    printf("  -h, --help             Display this help message.\n");
+}
+
+static int parse_host_port(const char *text, char **host, int *port) {
+    const char *colon = strrchr(text, ':');
+    if (!colon || colon == text) {
+        return -1;
+    }
+    *port = atoi(colon + 1);
+    if (*port < 1 || *port > 65535) {
+        return -1;
+    }
+    *host = strndup(text, colon - text);
+    return *host ? 0 : -1;
+}
+
+enum {
+    OPT_UP_RATE = 256,
+    OPT_DOWN_RATE,
+    OPT_LOSS_BURST,
+    OPT_LOSS_PENALTY,
+    OPT_STALL_EVERY,
+    OPT_STALL,
+    OPT_SEED
+};
+
+int main(int argc, char *argv[]) {
+    config.listen_addr = "127.0.0.1";
+    config.listen_port = 18000;
+    config.target_host = NULL;
+    config.loss_burst = 1.0;
+    config.loss_penalty_ms = -1.0;
+    config.stall_ms = 500.0;
+    config.seed = (unsigned int)uv_hrtime();
+
+    static struct option long_options[] = {
+        {"target", required_argument, 0, 't'},
+        {"listen-addr", required_argument, 0, 'a'},
+        {"listen-port", required_argument, 0, 'p'},
+        {"delay", required_argument, 0, 'd'},
+        {"jitter", required_argument, 0, 'j'},
+        {"rate", required_argument, 0, 'r'},
+        {"up-rate", required_argument, 0, OPT_UP_RATE},
+        {"down-rate", required_argument, 0, OPT_DOWN_RATE},
+        {"loss", required_argument, 0, 'L'},
+        {"loss-burst", required_argument, 0, OPT_LOSS_BURST},
+        {"loss-penalty", required_argument, 0, OPT_LOSS_PENALTY},
+        {"stall-every", required_argument, 0, OPT_STALL_EVERY},
+        {"stall", required_argument, 0, OPT_STALL},
+        {"seed", required_argument, 0, OPT_SEED},
+        {"verbose", no_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, "t:a:p:d:j:r:L:vh", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 't':
+                if (parse_host_port(optarg, &config.target_host, &config.target_port) != 0) {
+                    fprintf(stderr, "Error: Target must be HOST:PORT.\n");
+                    return 1;
+                }
+                break;
+            case 'a':
+                config.listen_addr = optarg;
+                break;
+            case 'p':
+                config.listen_port = atoi(optarg);
+                if (config.listen_port < 1 || config.listen_port > 65535) {
+                    fprintf(stderr, "Error: Listen port must be between 1 and 65535.\n");
+                    return 1;
+                }
+                break;
+            case 'd':
+                config.delay_ms = atof(optarg);
+                break;
+            case 'j':
+                config.jitter_ms = atof(optarg);
+                break;
+            case 'r':
+                config.up_rate_mbps = config.down_rate_mbps = atof(optarg);
+                break;
+            case OPT_UP_RATE:
+                config.up_rate_mbps = atof(optarg);
+                break;
+            case OPT_DOWN_RATE:
+                config.down_rate_mbps = atof(optarg);
+                break;
+            case 'L':
+                config.loss_pct = atof(optarg);
+                if (config.loss_pct < 0.0 || config.loss_pct >= 100.0) {
+                    fprintf(stderr, "Error: Loss must be between 0 and 100 percent.\n");
+                    return 1;
+                }
+                break;
+            case OPT_LOSS_BURST:
+                config.loss_burst = atof(optarg);
+                if (config.loss_burst < 1.0) {
+                    fprintf(stderr, "Error: Loss burst length must be at least 1 segment.\n");
+                    return 1;
+                }
+                break;
+            case OPT_LOSS_PENALTY:
+                config.loss_penalty_ms = atof(optarg);
+                break;
+            case OPT_STALL_EVERY:
+                config.stall_every_s = atof(optarg);
+                break;
+            case OPT_STALL:
+                config.stall_ms = atof(optarg);
+                break;
+            case OPT_SEED:
+                config.seed = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'v':
+                config.verbose = 1;
+                break;
+            case 'h':
+                config.help_flag = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (config.help_flag) {
+        print_usage(argv[0]);
+        return 0;
+    }
+    if (!config.target_host) {
+        fprintf(stderr, "Error: A target (-t HOST:PORT) is required.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (config.delay_ms < 0.0 || config.jitter_ms < 0.0 || config.up_rate_mbps < 0.0 || config.down_rate_mbps < 0.0 ||
+        config.stall_every_s < 0.0 || config.stall_ms < 0.0 ||
+        (config.stall_every_s > 0.0 && config.stall_ms >= config.stall_every_s * 1000.0)) {
+        fprintf(stderr, "Error: Delays, rates and stalls must be positive, and a stall shorter than its period.\n");
+        return 1;
+    }
+
+    srand(config.seed);
+    loop = uv_default_loop();
+    start_ns = uv_hrtime();
+    up_link.rate_bytes_per_s = config.up_rate_mbps * 1e6 / 8.0;
+    down_link.rate_bytes_per_s = config.down_rate_mbps * 1e6 / 8.0;
+
+    // The target is resolved once, so DNS does not add to the emulated latency
+    uv_getaddrinfo_t resolver;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char port_text[8];
+    snprintf(port_text, sizeof(port_text), "%d", config.target_port);
+    int rc = uv_getaddrinfo(loop, &resolver, NULL, config.target_host, port_text, &hints);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Resolving %s failed: %s\n", config.target_host, uv_strerror(rc));
+        return 1;
+    }
+    memcpy(&target_addr, resolver.addrinfo->ai_addr, resolver.addrinfo->ai_addrlen);
+    uv_freeaddrinfo(resolver.addrinfo);
+
+    struct sockaddr_storage listen_addr;
+    if (uv_ip4_addr(config.listen_addr, config.listen_port, (struct sockaddr_in *)&listen_addr) != 0 &&
+        uv_ip6_addr(config.listen_addr, config.listen_port, (struct sockaddr_in6 *)&listen_addr) != 0) {
+        fprintf(stderr, "Error: Invalid listen address %s.\n", config.listen_addr);
+        return 1;
+    }
+    uv_tcp_init(loop, &listener);
+    rc = uv_tcp_bind(&listener, (const struct sockaddr *)&listen_addr, 0);
+    if (rc == 0) {
+        rc = uv_listen((uv_stream_t *)&listener, 128, on_new_connection);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Error: Listening on %s:%d failed: %s\n", config.listen_addr, config.listen_port, uv_strerror(rc));
+        return 1;
+    }
+    uv_signal_init(loop, &sigint_handle);
+    uv_signal_start(&sigint_handle, on_signal, SIGINT);
+
+    printf("WAN emulation proxy %s:%d -> %s:%d\n", config.listen_addr, config.listen_port, config.target_host,
+           config.target_port);
+    printf("  delay %.1f ms +/- %.1f ms, up %s, down %s, loss %.2f%% (burst %.1f), ", config.delay_ms, config.jitter_ms,
+           config.up_rate_mbps > 0.0 ? "capped" : "unlimited", config.down_rate_mbps > 0.0 ? "capped" : "unlimited",
+           config.loss_pct, config.loss_burst);
+    if (config.stall_every_s > 0.0) {
+        printf("%.0f ms stall every %.1f s\n", config.stall_ms, config.stall_every_s);
+    } else {
+        printf("no stalls\n");
+    }
+    if (config.up_rate_mbps > 0.0 || config.down_rate_mbps > 0.0) {
+        printf("  rates: up %.2f Mbps, down %.2f Mbps\n", config.up_rate_mbps, config.down_rate_mbps);
+    }
+    printf("  seed %u\n", config.seed);
+    fflush(stdout);
+
+    uv_run(loop, UV_RUN_DEFAULT);
+    uv_loop_close(loop);
+    free(config.target_host);
+    return 0;
+}